@@ -0,0 +1,144 @@
+#ifndef _ARITHMETIC_HPP
+#define _ARITHMETIC_HPP
+
+#include "gpu.hpp"
+#include "benchmark.hpp"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <format>
+
+// Kernels of the arithmetic experiment that other experiments reuse.
+namespace arithmetic {
+    constexpr int trials_per_thread = 256;
+
+    // Runs `f` trials_per_thread times in every thread. If `timestamps` is not null, the
+    // start and end of every wave are written to it (see benchmark::wave_timer).
+    template <int block_size, typename F>
+    __global__ __launch_bounds__(block_size)
+    void test_kernel(F f, benchmark::wave_timestamp* timestamps) {
+        const auto timer = benchmark::wave_timer::start();
+
+        #pragma clang loop unroll_count(16)
+        for (int i = 0; i < trials_per_thread; ++i) {
+            f();
+        }
+
+        if (timestamps) {
+            timer.stop(timestamps);
+        }
+    }
+
+    // Number of dependent steps in every chain of chain_kernel.
+    constexpr int chain_length = 256;
+    // A number of chains is considered enough to hide the latency once it reaches this
+    // fraction of the peak throughput.
+    constexpr double chain_saturation = 0.95;
+
+    // Runs `chains` independent dependency chains of `f`, where every step takes the result
+    // of the previous step in the same chain as input. With a single chain this measures
+    // the latency of `f`, and with more chains how many need to be in flight to reach the
+    // issue rate. Kernels are only compiled for the given families.
+    template <gpu::family_set families, int chains, typename T, typename F>
+    __global__
+    void chain_kernel(F f, T init, benchmark::wave_timestamp* timestamps) {
+        if constexpr (families.contains(gpu::get_device_family())) {
+            T state[chains];
+            #pragma unroll
+            for (int c = 0; c < chains; ++c) {
+                state[c] = init;
+            }
+
+            const auto timer = benchmark::wave_timer::start();
+
+            #pragma clang loop unroll_count(8)
+            for (int i = 0; i < chain_length; ++i) {
+                #pragma unroll
+                for (int c = 0; c < chains; ++c) {
+                    state[c] = f(state[c]);
+                }
+            }
+
+            timer.stop(timestamps);
+
+            #pragma unroll
+            for (int c = 0; c < chains; ++c) {
+                gpu::do_not_optimize(state[c]);
+            }
+        }
+    }
+
+    // Runs chain_kernel for every number of chains in `chain_counts`, with a single wave
+    // on every SIMD so that the waves don't compete for issue slots. Reports the cycles per
+    // step and the instructions per cycle of a wave for every number of chains, and the
+    // latency and the number of chains needed to get close to the peak in a summary.
+    template <gpu::family_set families, int... chain_counts, typename T, typename F>
+    void chain_sweep(benchmark::executor& exec, const std::string& name, F f, T init) {
+        struct point {
+            int chains;
+            double cycles_per_step;
+            double insts_per_cycle;
+            benchmark::benchmark_stats stats;
+        };
+
+        const auto waves = exec.dev.properties.total_simds();
+        const gpu::launch_config cfg = {
+            .grid_size = waves,
+            .block_size = exec.dev.properties.warp_size,
+        };
+
+        exec.log() << name << " dependency chains:\n";
+
+        auto points = std::vector<point>();
+        const auto run = [&]<int chains>() {
+            const auto stats = exec.bench_waves(waves, [&](const auto& stream, auto* timestamps) {
+                stream.launch(cfg, chain_kernel<families, chains, T, F>, f, init, timestamps);
+            });
+            const auto cycles = stats.waves->cycles.median;
+            const auto& p = points.emplace_back(point{
+                .chains = chains,
+                .cycles_per_step = cycles / chain_length,
+                .insts_per_cycle = chains * chain_length / cycles,
+                .stats = stats,
+            });
+
+            exec.log() << std::format("  {:>2} chains: {:>8.2f} cycles/step, {:.3f} inst/cycle\n", chains, p.cycles_per_step, p.insts_per_cycle);
+
+            exec.report({
+                .name = name,
+                .parameters = {{"chains", chains}, {"chain_length", chain_length}},
+                .stats = stats,
+                .metrics = {
+                    {"cycles_per_step", p.cycles_per_step},
+                    {"insts_per_cycle", p.insts_per_cycle},
+                },
+            });
+        };
+        (run.template operator()<chain_counts>(), ...);
+
+        const auto peak = std::ranges::max(points, {}, &point::insts_per_cycle).insts_per_cycle;
+        const auto& knee = *std::ranges::find_if(points, [&](const auto& p) {
+            return p.insts_per_cycle >= chain_saturation * peak;
+        });
+        // The first point is expected to be a single chain.
+        const auto latency = points.front().cycles_per_step;
+
+        exec.log() << "  latency:         " << latency << " cycles\n";
+        exec.log() << "  chains for peak: " << knee.chains << " (" << peak << " inst/cycle)\n";
+        exec.log() << '\n';
+
+        exec.report({
+            .name = name + "_ilp",
+            .parameters = {{"chain_length", chain_length}},
+            .stats = knee.stats,
+            .metrics = {
+                {"latency_cycles", latency},
+                {"chains_for_peak", static_cast<double>(knee.chains)},
+                {"peak_insts_per_cycle", peak},
+            },
+        });
+    }
+}
+
+#endif
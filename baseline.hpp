@@ -0,0 +1,366 @@
+#ifndef _BASELINE_HPP
+#define _BASELINE_HPP
+
+#include "common.hpp"
+#include "benchmark.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <unordered_map>
+#include <fstream>
+#include <charconv>
+#include <cmath>
+#include <limits>
+
+namespace benchmark {
+    // Identifies a result within a run: the experiment, the name and every parameter. This
+    // is what results are matched by between devices and between runs.
+    inline std::string result_key(std::string_view experiment, const result& r) {
+        auto key = std::format("{}/{}", experiment, r.name);
+        for (const auto& param : r.parameters) {
+            key += std::visit([&](const auto& v) { return std::format(" {}={}", param.name, v); }, param.value);
+        }
+        return key;
+    }
+
+    // Just enough of a JSON reader to load back the files that result_sink writes.
+    struct json {
+        using array = std::vector<json>;
+        using object = std::vector<std::pair<std::string, json>>;
+
+        std::variant<std::nullptr_t, bool, int64_t, double, std::string, array, object> value;
+
+        // Returns the member `key` of an object, or null if there is no such member or if
+        // this is not an object.
+        const json* find(std::string_view key) const {
+            if (const auto* members = std::get_if<object>(&this->value)) {
+                for (const auto& [name, member] : *members) {
+                    if (name == key) {
+                        return &member;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        // Returns the value of a number, or NaN if this is not a number. Non-finite numbers
+        // are written as null.
+        double number() const {
+            if (const auto* i = std::get_if<int64_t>(&this->value)) {
+                return static_cast<double>(*i);
+            } else if (const auto* d = std::get_if<double>(&this->value)) {
+                return *d;
+            }
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        static json parse(std::string_view text) {
+            auto p = parser{.text = text};
+            auto result = p.parse_value();
+            p.skip_whitespace();
+            if (p.pos != text.size()) {
+                p.fail("trailing characters");
+            }
+            return result;
+        }
+
+    private:
+        struct parser {
+            std::string_view text;
+            size_t pos = 0;
+
+            [[noreturn]] void fail(std::string_view what) const {
+                throw traced_error("invalid JSON at offset {}: {}", this->pos, what);
+            }
+
+            void skip_whitespace() {
+                while (this->pos < this->text.size() && std::string_view(" \t\r\n").contains(this->text[this->pos])) {
+                    ++this->pos;
+                }
+            }
+
+            bool consume(std::string_view token) {
+                if (this->text.substr(this->pos).starts_with(token)) {
+                    this->pos += token.size();
+                    return true;
+                }
+                return false;
+            }
+
+            void expect(char c) {
+                this->skip_whitespace();
+                if (!this->consume(std::string_view(&c, 1))) {
+                    this->fail(std::format("expected '{}'", c));
+                }
+            }
+
+            json parse_value() {
+                this->skip_whitespace();
+                if (this->pos >= this->text.size()) {
+                    this->fail("unexpected end of input");
+                }
+
+                const auto c = this->text[this->pos];
+                if (c == '{') {
+                    return this->parse_object();
+                } else if (c == '[') {
+                    return this->parse_array();
+                } else if (c == '"') {
+                    return {this->parse_string()};
+                } else if (this->consume("null")) {
+                    return {nullptr};
+                } else if (this->consume("true")) {
+                    return {true};
+                } else if (this->consume("false")) {
+                    return {false};
+                }
+                return this->parse_number();
+            }
+
+            json parse_object() {
+                this->expect('{');
+                auto members = object();
+                this->skip_whitespace();
+                if (this->consume("}")) {
+                    return {std::move(members)};
+                }
+                while (true) {
+                    this->skip_whitespace();
+                    auto name = this->parse_string();
+                    this->expect(':');
+                    members.emplace_back(std::move(name), this->parse_value());
+                    this->skip_whitespace();
+                    if (this->consume("}")) {
+                        return {std::move(members)};
+                    }
+                    this->expect(',');
+                }
+            }
+
+            json parse_array() {
+                this->expect('[');
+                auto items = array();
+                this->skip_whitespace();
+                if (this->consume("]")) {
+                    return {std::move(items)};
+                }
+                while (true) {
+                    items.push_back(this->parse_value());
+                    this->skip_whitespace();
+                    if (this->consume("]")) {
+                        return {std::move(items)};
+                    }
+                    this->expect(',');
+                }
+            }
+
+            // Only the escapes that result_sink writes are supported.
+            std::string parse_string() {
+                if (!this->consume("\"")) {
+                    this->fail("expected a string");
+                }
+                auto result = std::string();
+                while (this->pos < this->text.size()) {
+                    const auto c = this->text[this->pos++];
+                    if (c == '"') {
+                        return result;
+                    } else if (c != '\\') {
+                        result += c;
+                    } else if (this->consume("\"")) {
+                        result += '"';
+                    } else if (this->consume("\\")) {
+                        result += '\\';
+                    } else if (this->consume("n")) {
+                        result += '\n';
+                    } else if (this->consume("t")) {
+                        result += '\t';
+                    } else if (this->consume("u") && this->pos + 4 <= this->text.size()) {
+                        uint32_t code;
+                        const auto digits = this->text.substr(this->pos, 4);
+                        const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), code, 16);
+                        if (ec != std::errc() || end != digits.data() + digits.size() || code >= 0x80) {
+                            this->fail("unsupported escape");
+                        }
+                        result += static_cast<char>(code);
+                        this->pos += 4;
+                    } else {
+                        this->fail("unsupported escape");
+                    }
+                }
+                this->fail("unterminated string");
+            }
+
+            // Numbers without a fraction or exponent are integers, so that parameters
+            // format the same as when they were reported.
+            json parse_number() {
+                const auto start = this->pos;
+                while (this->pos < this->text.size() && std::string_view("+-0123456789.eE").contains(this->text[this->pos])) {
+                    ++this->pos;
+                }
+                const auto str = this->text.substr(start, this->pos - start);
+                const auto* first = str.data();
+                const auto* last = str.data() + str.size();
+
+                if (str.find_first_of(".eE") == std::string_view::npos) {
+                    int64_t i;
+                    const auto [end, ec] = std::from_chars(first, last, i);
+                    if (ec == std::errc() && end == last) {
+                        return {i};
+                    }
+                } else {
+                    double d;
+                    const auto [end, ec] = std::from_chars(first, last, d);
+                    if (ec == std::errc() && end == last) {
+                        return {d};
+                    }
+                }
+                this->fail("invalid value");
+            }
+        };
+    };
+
+    // A result as read back from a JSON Lines file written by result_sink, with only the
+    // fields that are needed to compare it with other results.
+    struct recorded_result {
+        std::string arch_name;
+        // Files from before variants were recorded are from the default build.
+        std::string variant;
+        // See result_key().
+        std::string key;
+        // Files from before cache states were recorded always flushed with a memset.
+        std::string cache_state;
+        double runtime_average_ns;
+        double runtime_stddev_ns;
+        double runtime_median_ns;
+        size_t samples;
+    };
+
+    inline std::vector<recorded_result> load_results(const std::string& path) {
+        if (path.ends_with(".csv")) {
+            throw traced_error("'{}' must be a JSON Lines results file", path);
+        }
+
+        auto in = std::ifstream(path);
+        if (!in) {
+            throw traced_error("failed to open results file '{}'", path);
+        }
+
+        auto results = std::vector<recorded_result>();
+        auto line = std::string();
+        for (size_t line_number = 1; std::getline(in, line); ++line_number) {
+            if (line.empty()) {
+                continue;
+            }
+
+            try {
+                const auto record = json::parse(line);
+                const auto* experiment = record.find("experiment");
+                const auto* name = record.find("name");
+                const auto* variant = record.find("variant");
+                const auto* cache_state = record.find("cache_state");
+                const auto* device = record.find("device");
+                const auto* arch_name = device ? device->find("arch_name") : nullptr;
+                const auto* runtime = record.find("runtime_ns");
+                if (!experiment || !name || !arch_name || !runtime) {
+                    throw traced_error("missing fields");
+                }
+
+                auto r = benchmark::result{.name = std::get<std::string>(name->value)};
+                if (const auto* params = record.find("parameters")) {
+                    for (const auto& [param, value] : std::get<json::object>(params->value)) {
+                        std::visit([&](const auto& v) {
+                            using T = std::decay_t<decltype(v)>;
+                            if constexpr (std::is_same_v<T, int64_t> || std::is_same_v<T, double> || std::is_same_v<T, std::string>) {
+                                r.parameters.emplace_back(param, v);
+                            } else {
+                                throw traced_error("unsupported value of parameter '{}'", param);
+                            }
+                        }, value.value);
+                    }
+                }
+
+                const auto field = [&](std::string_view member) {
+                    const auto* value = runtime->find(member);
+                    return value ? value->number() : std::numeric_limits<double>::quiet_NaN();
+                };
+
+                results.push_back({
+                    .arch_name = std::get<std::string>(arch_name->value),
+                    .variant = variant ? std::get<std::string>(variant->value) : std::string("default"),
+                    .key = result_key(std::get<std::string>(experiment->value), r),
+                    .cache_state = cache_state ? std::get<std::string>(cache_state->value) : std::string("memset"),
+                    .runtime_average_ns = field("average"),
+                    .runtime_stddev_ns = field("stddev"),
+                    .runtime_median_ns = field("median"),
+                    .samples = static_cast<size_t>(field("samples")),
+                });
+            } catch (const std::exception& e) {
+                throw traced_error("{}:{}: {}", path, line_number, e.what());
+            }
+        }
+        return results;
+    }
+
+    // The results of a previous run. Results are matched by the architecture of the device
+    // that they ran on, by the variant of the build, by the cache state and by result_key(),
+    // so that a run can be compared with one on another card of the same kind.
+    struct baseline {
+        using entry = recorded_result;
+
+        std::unordered_map<std::string, entry> entries;
+
+        static std::string key(std::string_view arch_name, std::string_view variant, std::string_view cache_state, std::string_view result_key) {
+            return std::format("{} {} {} {}", arch_name, variant, cache_state, result_key);
+        }
+
+        static baseline load(const std::string& path) {
+            auto result = baseline();
+            for (auto& r : load_results(path)) {
+                auto k = key(r.arch_name, r.variant, r.cache_state, r.key);
+                result.entries.insert_or_assign(std::move(k), std::move(r));
+            }
+            return result;
+        }
+
+        const entry* find(std::string_view arch_name, std::string_view variant, std::string_view cache_state, std::string_view result_key) const {
+            const auto it = this->entries.find(key(arch_name, variant, cache_state, result_key));
+            return it == this->entries.end() ? nullptr : &it->second;
+        }
+    };
+
+    // A difference in runtime is significant once it is this many standard errors of the
+    // difference of the averages away from zero.
+    constexpr double significance_threshold = 3;
+
+    struct baseline_delta {
+        // Relative change of the median runtime, positive if it got slower.
+        double change;
+        // The difference of the average runtimes over its standard error (Welch's t).
+        double t;
+
+        bool significant() const {
+            return std::abs(this->t) >= significance_threshold;
+        }
+
+        bool regression(double threshold) const {
+            return this->significant() && this->change > threshold;
+        }
+    };
+
+    inline baseline_delta compare(const baseline::entry& old, const statistic<duration>& now) {
+        const auto error = std::sqrt(
+            old.runtime_stddev_ns * old.runtime_stddev_ns / std::max<size_t>(old.samples, 1)
+            + now.stddev.count() * now.stddev.count() / std::max<size_t>(now.samples, 1)
+        );
+        const auto diff = now.average.count() - old.runtime_average_ns;
+        return {
+            .change = (now.median.count() - old.runtime_median_ns) / old.runtime_median_ns,
+            // Without any spread, every difference is significant.
+            .t = error > 0 ? diff / error : (diff == 0 ? 0 : std::copysign(std::numeric_limits<double>::infinity(), diff)),
+        };
+    }
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "gpu.hpp"
 #include "common.hpp"
+#include "counters.hpp"
+#include "telemetry.hpp"
 
 #include <amd_smi/amdsmi.h>
 
@@ -11,12 +13,36 @@
 #include <ranges>
 #include <algorithm>
 #include <thread>
+#include <optional>
+#include <unordered_map>
+#include <limits>
+#include <span>
+#include <variant>
+#include <memory>
+#include <fstream>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <mutex>
+#include <ostream>
+#include <map>
 
 namespace benchmark {
     using duration = std::chrono::duration<double, std::nano>;
 
-    constexpr size_t warmups = 10;
-    constexpr size_t iterations = 50;
+    constexpr size_t default_warmups = 10;
+    constexpr size_t default_iterations = 50;
+
+    // The variant of the build, which differ in how the kernels are compiled. See the
+    // variants in CMakeLists.txt.
+#ifdef BENCHMARK_VARIANT
+    constexpr const char* build_variant = BENCHMARK_VARIANT;
+#else
+    constexpr const char* build_variant = "default";
+#endif
+
+    // Upper bound on the size of the buffer used to collect wave timestamps.
+    constexpr size_t max_timestamp_bytes = 256 * 1024 * 1024;
 
     struct size {
         size_t count;
@@ -81,29 +107,596 @@ namespace benchmark {
         }                                             \
     }
 
+    // amdsmi_init() and amdsmi_shut_down() are not reference counted, so when several
+    // executors are alive at once (one for each device) only the first should initialize
+    // the library and only the last one should shut it down.
+    struct amdsmi_library {
+        static std::mutex& mutex() {
+            static auto m = std::mutex();
+            return m;
+        }
+
+        static size_t& users() {
+            static size_t count = 0;
+            return count;
+        }
+
+        amdsmi_library() {
+            const auto lock = std::lock_guard(mutex());
+            if (users() == 0) {
+                AMDSMI_TRY(amdsmi_init(AMDSMI_INIT_AMD_GPUS));
+            }
+            ++users();
+        }
+
+        amdsmi_library(const amdsmi_library&) = delete;
+        amdsmi_library& operator=(const amdsmi_library&) = delete;
+
+        ~amdsmi_library() {
+            const auto lock = std::lock_guard(mutex());
+            if (--users() == 0) {
+                assert(amdsmi_shut_down() == AMDSMI_STATUS_SUCCESS);
+            }
+        }
+    };
+
+    // Timing record of a single wave, written by the kernel under test via wave_timer.
+    struct wave_timestamp {
+        // memrealtime() when the wave started and stopped.
+        uint64_t start;
+        uint64_t stop;
+        // memtime() cycles between start and stop.
+        uint64_t cycles;
+        // Hardware id of the CU that the wave ran on.
+        uint32_t cu;
+        uint32_t padding;
+    };
+
+    // Kernel-side timer: construct at the start of the region of interest, and call stop()
+    // at the end to write the wave's record. Each wave in the grid gets its own record,
+    // so the buffer should hold grid size * waves per block entries.
+    struct wave_timer {
+        uint64_t start_realtime;
+        uint64_t start_cycles;
+
+        __device__ __forceinline__
+        static wave_timer start() {
+            return {
+                .start_realtime = gpu::memrealtime(),
+                .start_cycles = gpu::memtime(),
+            };
+        }
+
+        __device__ __forceinline__
+        void stop(wave_timestamp* timestamps) const {
+            const auto stop_cycles = gpu::memtime();
+            const auto stop_realtime = gpu::memrealtime();
+
+            if (__lane_id() == 0) {
+                const auto waves_per_block = (blockDim.x + warpSize - 1) / warpSize;
+                const auto wave = blockIdx.x * waves_per_block + threadIdx.x / warpSize;
+                timestamps[wave] = {
+                    .start = this->start_realtime,
+                    .stop = stop_realtime,
+                    .cycles = (stop_cycles - this->start_cycles) & gpu::memtime_mask(),
+                    .cu = __smid(),
+                };
+            }
+        }
+    };
+
+    struct wave_stats {
+        // Duration of a single wave, in shader cycles.
+        statistic<double> cycles;
+        // Time between the first wave of a launch starting and the last one finishing.
+        // The difference between this and the event time is the dispatch overhead.
+        statistic<duration> span;
+        // Total cycles spent by the waves of a launch on each CU. A large spread here
+        // means that the waves were not evenly distributed over the CUs.
+        statistic<double> cu_cycles;
+    };
+
+    // How executor::bench issues the timed launches.
+    enum class launch_mode {
+        // Synchronize with the device before and after every launch.
+        serial,
+        // Enqueue the cache flush and the launch of every iteration on the stream at once,
+        // and only synchronize at the end. This keeps the device busy rather than waiting
+        // on the host, but launches may start while the host is still enqueueing.
+        batched,
+        // Like batched, but capture all iterations into a HIP graph and replay it.
+        graph,
+    };
+
+    inline std::optional<launch_mode> parse_launch_mode(std::string_view str) {
+        if (str == "serial") {
+            return launch_mode::serial;
+        } else if (str == "batched") {
+            return launch_mode::batched;
+        } else if (str == "graph") {
+            return launch_mode::graph;
+        }
+        return std::nullopt;
+    }
+
+    // The state that executor::bench puts the caches in before every timed launch.
+    enum class cache_state {
+        // Overwrite a buffer the size of the largest cache with a memset. This is cheap to
+        // issue, but the writes may not displace lines in the same way as reads would.
+        memset,
+        // Read a buffer the size of the largest cache with a kernel, displacing what the
+        // timed launch left behind.
+        read,
+        // Invalidate the caches in front of the L2 with a kernel that runs on every CU.
+        // The L2 and anything behind it keep their contents.
+        invalidate,
+        // Don't flush at all, so that the timed launch finds whatever the warmups and the
+        // previous iteration left in the caches.
+        warm,
+    };
+
+    inline std::optional<cache_state> parse_cache_state(std::string_view str) {
+        if (str == "memset") {
+            return cache_state::memset;
+        } else if (str == "read") {
+            return cache_state::read;
+        } else if (str == "invalidate") {
+            return cache_state::invalidate;
+        } else if (str == "warm") {
+            return cache_state::warm;
+        }
+        return std::nullopt;
+    }
+
+    constexpr const char* cache_state_name(cache_state state) {
+        switch (state) {
+            case cache_state::memset: return "memset";
+            case cache_state::read: return "read";
+            case cache_state::invalidate: return "invalidate";
+            case cache_state::warm: return "warm";
+        }
+        return "unknown";
+    }
+
+    // Reads all of `buffer`, see cache_state::read.
+    inline __global__ __launch_bounds__(256)
+    void cache_read_kernel(const uint4* __restrict__ buffer, size_t count) {
+        uint32_t acc = 0;
+        for (size_t i = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x; i < count; i += static_cast<size_t>(gridDim.x) * blockDim.x) {
+            const auto v = buffer[i];
+            acc ^= v.x ^ v.y ^ v.z ^ v.w;
+        }
+        gpu::do_not_optimize(acc);
+    }
+
+    // Invalidates the vector caches of the CU that a wave runs on, see
+    // cache_state::invalidate. On CDNA3 and later, the agent scope invalidate also drops
+    // the lines of the L2 that may be stale.
+    inline __global__ __launch_bounds__(64)
+    void cache_invalidate_kernel() {
+        #if defined(GPU_FAMILY_CDNA3) || defined(GPU_FAMILY_CDNA4)
+            asm volatile("buffer_inv sc1" ::: "memory");
+        #elif defined(GPU_FAMILY_CDNA1) || defined(GPU_FAMILY_CDNA2) || defined(GPU_FAMILY_GCN5)
+            asm volatile("buffer_wbinvl1" ::: "memory");
+        #elif defined(GPU_FAMILY_RDNA1) || defined(GPU_FAMILY_RDNA2) || defined(GPU_FAMILY_RDNA3)
+            asm volatile("buffer_gl0_inv\n\tbuffer_gl1_inv" ::: "memory");
+        #elif defined(GPU_FAMILY_RDNA4)
+            asm volatile("global_inv scope:SCOPE_DEV" ::: "memory");
+        #endif
+    }
+
+    // Settings for adaptive sampling, where the executor keeps sampling until the median
+    // runtime is known precisely enough, rather than taking a fixed number of samples.
+    struct adaptive_options {
+        // Stop once the half-width of the 95% confidence interval of the median is less
+        // than this fraction of the median.
+        double target_ci = 0.01;
+        // Stop after sampling for this long, even if the target was not reached.
+        std::chrono::milliseconds time_budget = std::chrono::seconds(2);
+        size_t min_iterations = 10;
+        size_t max_iterations = 100'000;
+    };
+
+    // Returns the half-width of the distribution-free 95% confidence interval of the
+    // median of `items`, relative to the median. This is based on the ranks of the
+    // order statistics, so it does not assume that the items are normally distributed.
+    inline double relative_median_ci(std::vector<duration> items) {
+        std::ranges::sort(items);
+        const auto n = static_cast<double>(items.size());
+        const auto spread = 0.98 * std::sqrt(n);
+        const auto lo = static_cast<size_t>(std::max(0.0, std::floor(n / 2 - spread)));
+        const auto hi = static_cast<size_t>(std::min(n - 1, std::ceil(n / 2 + spread)));
+        const auto median = statistic<duration>::percentile(items, 0.5);
+        return (items[hi] - items[lo]).count() / 2 / median.count();
+    }
+
     struct benchmark_stats {
         statistic<duration> runtime;
         statistic<double> clock_rate;
+        // Relative half-width of the 95% confidence interval of the median runtime.
+        double median_ci;
+        // Only set by executor::bench_waves().
+        std::optional<wave_stats> waves;
+        // Average counter values of a single launch, if any were requested.
+        counter_values counters;
+        // Only set if telemetry is enabled on the executor.
+        std::optional<telemetry_stats> telemetry;
+        // The state of the caches at the start of every timed launch.
+        cache_state cache = cache_state::memset;
+        // Time taken by a single flush, which is not part of the runtime. Not set if the
+        // caches were not flushed.
+        std::optional<statistic<duration>> flush;
+    };
+
+    template <typename T>
+    constexpr const char* type_name();
+
+    template <> constexpr const char* type_name<int32_t>() { return "i32"; }
+    template <> constexpr const char* type_name<uint32_t>() { return "u32"; }
+    template <> constexpr const char* type_name<uint64_t>() { return "u64"; }
+    template <> constexpr const char* type_name<__uint128_t>() { return "u128"; }
+    template <> constexpr const char* type_name<float>() { return "f32"; }
+    template <> constexpr const char* type_name<double>() { return "f64"; }
+
+    // A parameter of a test, for example the block size or the data type.
+    struct parameter {
+        using value_type = std::variant<int64_t, double, std::string>;
+
+        std::string name;
+        value_type value;
+
+        template <typename T>
+        parameter(std::string name, const T& value):
+            name(std::move(name)),
+            value(to_value(value))
+        {}
+
+    private:
+        template <typename T>
+        static value_type to_value(const T& value) {
+            if constexpr (std::is_same_v<T, bool>) {
+                return std::string(value ? "true" : "false");
+            } else if constexpr (std::is_integral_v<T>) {
+                return static_cast<int64_t>(value);
+            } else if constexpr (std::is_floating_point_v<T>) {
+                return static_cast<double>(value);
+            } else {
+                return std::string(value);
+            }
+        }
+    };
+
+    // The machine-readable result of a single test.
+    struct result {
+        std::string name;
+        std::vector<parameter> parameters;
+        benchmark_stats stats;
+        // Numbers derived from the stats, such as the throughput.
+        std::vector<std::pair<std::string, double>> metrics;
+    };
+
+    // Writes results to a file, either as JSON Lines or as CSV depending on the extension
+    // of the file. The human-readable output of the experiments is not affected by this.
+    struct result_sink {
+        enum class format {
+            json_lines,
+            csv,
+        };
+
+        std::ofstream out;
+        format fmt;
+        bool header_written = false;
+        // The sink is shared between the executors of all devices, which may run concurrently.
+        std::mutex mutex;
+
+        explicit result_sink(const std::string& path):
+            out(path),
+            fmt(path.ends_with(".csv") ? format::csv : format::json_lines)
+        {
+            if (!this->out) {
+                throw traced_error("failed to open results file '{}'", path);
+            }
+        }
+
+        // Opens the file given by the BENCHMARK_RESULTS environment variable, if set.
+        static std::shared_ptr<result_sink> from_environment() {
+            const char* path = std::getenv("BENCHMARK_RESULTS");
+            if (!path || !*path) {
+                return nullptr;
+            }
+            return std::make_shared<result_sink>(path);
+        }
+
+        void write(std::string_view experiment, const gpu::device& dev, const result& r) {
+            const auto lock = std::lock_guard(this->mutex);
+            switch (this->fmt) {
+                case format::json_lines:
+                    this->write_json(experiment, dev, r);
+                    break;
+                case format::csv:
+                    this->write_csv(experiment, dev, r);
+                    break;
+            }
+            this->out.flush();
+        }
+
+    private:
+        static std::string json_string(std::string_view str) {
+            auto escaped = std::string("\"");
+            for (const char c : str) {
+                switch (c) {
+                    case '"': escaped += "\\\""; break;
+                    case '\\': escaped += "\\\\"; break;
+                    case '\n': escaped += "\\n"; break;
+                    case '\t': escaped += "\\t"; break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20) {
+                            escaped += std::format("\\u{:04x}", static_cast<int>(c));
+                        } else {
+                            escaped += c;
+                        }
+                }
+            }
+            escaped += '"';
+            return escaped;
+        }
+
+        static std::string json_number(double value) {
+            // JSON has no representation for these.
+            if (!std::isfinite(value)) {
+                return "null";
+            }
+            return std::format("{}", value);
+        }
+
+        static std::string json_value(const parameter::value_type& value) {
+            return std::visit([](const auto& v) {
+                using T = std::decay_t<decltype(v)>;
+                if constexpr (std::is_same_v<T, std::string>) {
+                    return json_string(v);
+                } else if constexpr (std::is_same_v<T, double>) {
+                    return json_number(v);
+                } else {
+                    return std::format("{}", v);
+                }
+            }, value);
+        }
+
+        static std::string csv_value(const parameter::value_type& value) {
+            return std::visit([](const auto& v) { return std::format("{}", v); }, value);
+        }
+
+        template <typename T>
+        static double to_number(const T& value) {
+            if constexpr (requires { value.count(); }) {
+                return static_cast<double>(value.count());
+            } else {
+                return static_cast<double>(value);
+            }
+        }
+
+        template <typename T>
+        static std::string json_statistic(const statistic<T>& stat) {
+            return std::format(
+                "{{\"average\":{},\"stddev\":{},\"min\":{},\"max\":{},\"median\":{},\"p05\":{},\"p95\":{},\"samples\":{},\"outliers\":{}}}",
+                json_number(to_number(stat.average)),
+                json_number(to_number(stat.stddev)),
+                json_number(to_number(stat.smallest)),
+                json_number(to_number(stat.largest)),
+                json_number(to_number(stat.median)),
+                json_number(to_number(stat.p05)),
+                json_number(to_number(stat.p95)),
+                stat.samples,
+                stat.outliers
+            );
+        }
+
+        void write_json(std::string_view experiment, const gpu::device& dev, const result& r) {
+            const auto& props = dev.properties;
+
+            auto line = std::format(
+                "{{\"experiment\":{},\"name\":{},\"variant\":{},\"device\":{{\"device_name\":{},\"arch_name\":{},\"pci_address\":{},"
+                "\"total_global_mem\":{},\"warp_size\":{},\"compute_units\":{},\"simds_per_cu\":{},\"cache_size\":[{}]}}",
+                json_string(experiment),
+                json_string(r.name),
+                json_string(build_variant),
+                json_string(props.device_name),
+                json_string(props.arch_name),
+                json_string(std::format("{}", props.pci_address)),
+                props.total_global_mem,
+                props.warp_size,
+                props.compute_units,
+                props.simds_per_cu,
+                std::format("{},{},{},{}", props.cache_size[0], props.cache_size[1], props.cache_size[2], props.cache_size[3])
+            );
+
+            line += ",\"parameters\":{";
+            for (size_t i = 0; i < r.parameters.size(); ++i) {
+                line += std::format("{}{}:{}", i == 0 ? "" : ",", json_string(r.parameters[i].name), json_value(r.parameters[i].value));
+            }
+            line += "}";
+
+            line += std::format(",\"runtime_ns\":{}", json_statistic(r.stats.runtime));
+            line += std::format(",\"runtime_median_ci\":{}", json_number(r.stats.median_ci));
+            line += std::format(",\"clock_mhz\":{}", json_statistic(r.stats.clock_rate));
+            line += std::format(",\"cache_state\":{}", json_string(cache_state_name(r.stats.cache)));
+            if (r.stats.flush) {
+                line += std::format(",\"flush_ns\":{}", json_statistic(*r.stats.flush));
+            }
+            if (r.stats.telemetry) {
+                const auto& t = *r.stats.telemetry;
+                line += std::format(
+                    ",\"telemetry\":{{\"sclk_mhz\":{},\"mclk_mhz\":{},\"power_w\":{},\"junction_temp_c\":{},\"throttled_iterations\":{}}}",
+                    json_statistic(t.sclk_mhz),
+                    json_statistic(t.mclk_mhz),
+                    json_statistic(t.power_w),
+                    json_statistic(t.junction_temp_c),
+                    t.throttled_iterations
+                );
+            }
+            if (r.stats.waves) {
+                line += std::format(",\"wave_cycles\":{}", json_statistic(r.stats.waves->cycles));
+                line += std::format(",\"wave_span_ns\":{}", json_statistic(r.stats.waves->span));
+                line += std::format(",\"cu_cycles\":{}", json_statistic(r.stats.waves->cu_cycles));
+            }
+
+            line += ",\"counters\":{";
+            for (size_t i = 0; i < r.stats.counters.size(); ++i) {
+                line += std::format("{}{}:{}", i == 0 ? "" : ",", json_string(r.stats.counters[i].first), json_number(r.stats.counters[i].second));
+            }
+            line += "}";
+
+            line += ",\"metrics\":{";
+            for (size_t i = 0; i < r.metrics.size(); ++i) {
+                line += std::format("{}{}:{}", i == 0 ? "" : ",", json_string(r.metrics[i].first), json_number(r.metrics[i].second));
+            }
+            line += "}}";
+
+            this->out << line << '\n';
+        }
+
+        static std::string csv_field(std::string_view str) {
+            if (str.find_first_of(",\"\n") == std::string_view::npos) {
+                return std::string(str);
+            }
+
+            auto quoted = std::string("\"");
+            for (const char c : str) {
+                if (c == '"') {
+                    quoted += '"';
+                }
+                quoted += c;
+            }
+            quoted += '"';
+            return quoted;
+        }
+
+        void write_csv(std::string_view experiment, const gpu::device& dev, const result& r) {
+            // Parameters and metrics differ between tests, so they are stored as a single
+            // field of `key=value` pairs to keep the columns the same for every row.
+            if (!this->header_written) {
+                this->out << "experiment,name,device_name,arch_name,pci_address,parameters,"
+                    "runtime_average_ns,runtime_stddev_ns,runtime_min_ns,runtime_max_ns,"
+                    "runtime_median_ns,runtime_p05_ns,runtime_p95_ns,runtime_median_ci,samples,outliers,"
+                    "clock_average_mhz,clock_stddev_mhz,clock_min_mhz,clock_max_mhz,metrics,counters,telemetry,"
+                    "cache_state,flush_median_ns,variant\n";
+                this->header_written = true;
+            }
+
+            auto parameters = std::string();
+            for (const auto& param : r.parameters) {
+                parameters += std::format("{}{}={}", parameters.empty() ? "" : ";", param.name, csv_value(param.value));
+            }
+
+            auto metrics = std::string();
+            for (const auto& [name, value] : r.metrics) {
+                metrics += std::format("{}{}={}", metrics.empty() ? "" : ";", name, value);
+            }
+
+            auto counters = std::string();
+            for (const auto& [name, value] : r.stats.counters) {
+                counters += std::format("{}{}={}", counters.empty() ? "" : ";", name, value);
+            }
+
+            auto telemetry = std::string();
+            if (const auto& t = r.stats.telemetry) {
+                telemetry = std::format(
+                    "sclk_mhz={};mclk_mhz={};power_w={};junction_temp_c={};throttled_iterations={}",
+                    t->sclk_mhz.average,
+                    t->mclk_mhz.average,
+                    t->power_w.average,
+                    t->junction_temp_c.average,
+                    t->throttled_iterations
+                );
+            }
+
+            const auto& props = dev.properties;
+            const auto& runtime = r.stats.runtime;
+            const auto& clock = r.stats.clock_rate;
+            this->out << std::format(
+                "{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{}\n",
+                csv_field(experiment),
+                csv_field(r.name),
+                csv_field(props.device_name),
+                csv_field(props.arch_name),
+                props.pci_address,
+                csv_field(parameters),
+                runtime.average.count(),
+                runtime.stddev.count(),
+                runtime.smallest.count(),
+                runtime.largest.count(),
+                runtime.median.count(),
+                runtime.p05.count(),
+                runtime.p95.count(),
+                r.stats.median_ci,
+                runtime.samples,
+                runtime.outliers,
+                clock.average,
+                clock.stddev,
+                clock.smallest,
+                clock.largest,
+                csv_field(metrics),
+                csv_field(counters),
+                csv_field(telemetry),
+                cache_state_name(r.stats.cache),
+                r.stats.flush ? std::format("{}", r.stats.flush->median.count()) : std::string(),
+                build_variant
+            );
+        }
     };
 
     struct executor {
         const gpu::device& dev;
         gpu::stream stream;
         size_t max_cache_size;
-        gpu::ptr<std::byte> cache_buffer;
+        // Only allocated once a cache state that needs it is used.
+        std::optional<gpu::ptr<std::byte>> cache_buffer;
+        cache_state cache = cache_state::memset;
+        // Number of flushes that are timed to measure the cost of a cache state.
+        size_t flush_samples = 10;
+        // The measured cost of every cache state that was used so far.
+        std::map<cache_state, statistic<duration>> flush_times;
+
+        size_t warmups = default_warmups;
+        size_t iterations = default_iterations;
+        // If set, `iterations` is ignored and the number of samples is chosen adaptively.
+        std::optional<adaptive_options> adaptive;
+        // Compute the runtime statistic without the samples that lie far outside the rest.
+        bool reject_outliers = false;
+        launch_mode mode = launch_mode::serial;
+        // Hardware counters to collect for every benchmark, see counters.hpp.
+        std::vector<std::string> counters;
+        // Number of extra launches that counters are collected over. These are separate
+        // from the timed launches, so that the profiling overhead doesn't affect timing.
+        size_t counter_launches = 3;
 
+        amdsmi_library amdsmi;
         amdsmi_processor_handle amdsmi_dev;
         amdsmi_dev_perf_level_t orig_perf_level = AMDSMI_DEV_PERF_LEVEL_UNKNOWN;
+        // Background sampling of clocks, power and temperature, see enable_telemetry().
+        std::unique_ptr<telemetry_sampler> telemetry;
 
-        explicit executor(const gpu::device& dev):
+        // Name of the experiment that results are reported for, which defaults to the
+        // name of the executable.
+        std::string experiment = program_invocation_short_name;
+        // Where results are written to, if anywhere. This is shared between the executors
+        // of all devices, so it is opened by the driver rather than here.
+        std::shared_ptr<result_sink> results;
+        // Every result that was reported, so that they can be compared between devices.
+        std::vector<result> reported;
+        // Values given with `--param key=value`, which tests can use to customize what they
+        // measure.
+        std::map<std::string, std::string, std::less<>> params;
+        // Human-readable output of the tests. When running on multiple devices at once,
+        // this is a buffer that is printed after every test.
+        std::ostream* out;
+
+        explicit executor(const gpu::device& dev, std::ostream& out = std::cout):
             dev(dev),
             stream(this->dev.create_stream(gpu::stream::flags::non_blocking)),
             max_cache_size(this->dev.properties.largest_cache_size()),
-            cache_buffer(this->dev.alloc<std::byte>(this->max_cache_size))
+            out(&out)
         {
-            AMDSMI_TRY(amdsmi_init(AMDSMI_INIT_AMD_GPUS));
-
-            amdsmi_processor_handle amdsmi_dev;
             const auto addr = amdsmi_bdf_t{
                 .function_number = dev.properties.pci_address.function,
                 .device_number = dev.properties.pci_address.device,
@@ -112,7 +705,11 @@ namespace benchmark {
             };
             AMDSMI_TRY(amdsmi_get_processor_handle_from_bdf(addr, &this->amdsmi_dev));
 
-            std::cout << std::format("benchmarking on device '{}' ({})\n", this->dev.properties.device_name, this->dev.properties.pci_address);
+            this->log() << std::format("benchmarking on device '{}' ({})", this->dev.properties.device_name, this->dev.properties.pci_address);
+            if (std::string_view(build_variant) != "default") {
+                this->log() << " with the " << build_variant << " build";
+            }
+            this->log() << "\n";
 
             // Try to make performance deterministic
             // First query the current level so that we can reset it later.
@@ -148,8 +745,34 @@ namespace benchmark {
                     }
                 }
             }
+        }
 
-            assert(amdsmi_shut_down() == AMDSMI_STATUS_SUCCESS);
+        std::ostream& log() const {
+            return *this->out;
+        }
+
+        // Returns the value of `--param name=value`, if it was given.
+        std::optional<std::string_view> param(std::string_view name) const {
+            const auto it = this->params.find(name);
+            if (it == this->params.end()) {
+                return std::nullopt;
+            }
+            return it->second;
+        }
+
+        // Starts sampling the device's telemetry every `period`. When enabled, the clock rate
+        // of each iteration is taken from the samples during that iteration, rather than
+        // queried once after it finished.
+        void enable_telemetry(std::chrono::microseconds period) {
+            this->telemetry = std::make_unique<telemetry_sampler>(this->amdsmi_dev, period);
+        }
+
+        // Records the result of a test in the results file, if one was requested.
+        void report(const result& r) {
+            if (this->results) {
+                this->results->write(this->experiment, this->dev, r);
+            }
+            this->reported.push_back(r);
         }
 
         uint64_t get_gpu_sclk_freq_mhz() const {
@@ -163,42 +786,420 @@ namespace benchmark {
             return freqs.frequency[freqs.current];
         }
 
-        template <typename F>
-        benchmark_stats bench(F f) {
-            using ns = std::chrono::nanoseconds;
+        // Enqueues the work that puts the caches into the configured state on the stream.
+        // prepare_flush() must have been called since the cache state last changed.
+        void flush() {
+            switch (this->cache) {
+                case cache_state::memset:
+                    this->stream.memset(this->cache_buffer->raw, 0x00, this->max_cache_size);
+                    break;
+                case cache_state::read: {
+                    const gpu::launch_config cfg = {
+                        .grid_size = this->dev.properties.compute_units * 8,
+                        .block_size = 256,
+                    };
+                    this->stream.launch(cfg, cache_read_kernel, reinterpret_cast<const uint4*>(this->cache_buffer->raw), this->max_cache_size / sizeof(uint4));
+                    break;
+                }
+                case cache_state::invalidate: {
+                    // The hardware doesn't guarantee that every CU gets a wave, so launch
+                    // plenty of them.
+                    const gpu::launch_config cfg = {
+                        .grid_size = this->dev.properties.compute_units * 8,
+                        .block_size = 64,
+                    };
+                    this->stream.launch(cfg, cache_invalidate_kernel);
+                    break;
+                }
+                case cache_state::warm:
+                    break;
+            }
+        }
 
-            auto events = std::vector<std::pair<gpu::event, gpu::event>>(iterations);
+        // Allocates what the configured cache state needs and measures how long a flush
+        // takes, the first time that the cache state is used. This has to happen before
+        // the launches are timed or captured into a graph. Returns the cost of a flush, if
+        // the caches are flushed at all.
+        std::optional<statistic<duration>> prepare_flush() {
+            if (this->cache == cache_state::warm) {
+                return std::nullopt;
+            }
 
-            for (int i = 0; i < warmups; ++i) {
-                this->stream.memset(this->cache_buffer.raw, 0x00, this->max_cache_size);
-                dev.sync();
-                f(this->stream);
-                dev.sync();
+            if ((this->cache == cache_state::memset || this->cache == cache_state::read) && !this->cache_buffer) {
+                this->cache_buffer.emplace(this->dev.alloc<std::byte>(this->max_cache_size));
+                this->stream.memset(this->cache_buffer->raw, 0x00, this->max_cache_size);
             }
 
-            for (const auto& [start, stop] : events) {
-                this->stream.memset(this->cache_buffer.raw, 0x00, this->max_cache_size);
-                dev.sync();
+            if (const auto it = this->flush_times.find(this->cache); it != this->flush_times.end()) {
+                return it->second;
+            }
+
+            auto durations = std::vector<duration>();
+            const auto start = gpu::event();
+            const auto stop = gpu::event();
+            for (size_t i = 0; i < this->flush_samples; ++i) {
                 this->stream.record(start);
-                f(this->stream);
+                this->flush();
                 this->stream.record(stop);
-                dev.sync();
+                this->stream.sync();
+                durations.push_back(std::chrono::duration_cast<duration>(gpu::event::elapsed(start, stop)));
+            }
+
+            const auto flush = statistic(durations);
+            this->log() << std::format("  cache flush ({}): {:.2f} us\n", cache_state_name(this->cache), flush.median.count() / 1000);
+            this->flush_times.emplace(this->cache, flush);
+            return flush;
+        }
+
+        template <typename F>
+        benchmark_stats bench(F f) {
+            const auto flush = this->prepare_flush();
+
+            if (this->mode == launch_mode::serial) {
+                for (int i = 0; i < this->warmups; ++i) {
+                    this->flush();
+                    dev.sync();
+                    f(this->stream);
+                    dev.sync();
+                }
+            } else {
+                for (int i = 0; i < this->warmups; ++i) {
+                    this->flush();
+                    f(this->stream);
+                }
+                this->stream.sync();
+            }
+
+            auto counters = counter_values();
+            if (!this->counters.empty()) {
+                counters = this->collect_counters(f);
             }
 
             auto durations = std::vector<duration>();
-            durations.reserve(iterations);
             auto clock_rates = std::vector<double>();
-            clock_rates.reserve(iterations);
-            for (const auto& [start, stop] : events) {
-                const auto elapsed = std::chrono::duration_cast<duration>(gpu::event::elapsed(start, stop));
-                durations.push_back(elapsed);
-                clock_rates.push_back(this->get_gpu_sclk_freq_mhz());
+            auto windows = std::vector<telemetry_window>();
+            if (this->telemetry) {
+                this->telemetry->clear();
+            }
+
+            // Enqueues all iterations at once. The flush is ordered on the same stream, so
+            // it is still finished before the start event of its iteration.
+            const auto enqueue = [&](const std::vector<std::pair<gpu::event, gpu::event>>& events) {
+                for (const auto& [start, stop] : events) {
+                    this->flush();
+                    this->stream.record(start);
+                    f(this->stream);
+                    this->stream.record(stop);
+                }
+            };
+
+            const auto sample = [&](size_t n) {
+                using host_clock = telemetry_sampler::clock;
+
+                auto events = std::vector<std::pair<gpu::event, gpu::event>>(n);
+                // Host time at which each iteration was known to be finished.
+                auto synced = std::vector<host_clock::time_point>();
+
+                switch (this->mode) {
+                    case launch_mode::serial:
+                        for (const auto& [start, stop] : events) {
+                            this->flush();
+                            dev.sync();
+                            this->stream.record(start);
+                            f(this->stream);
+                            this->stream.record(stop);
+                            dev.sync();
+                            synced.push_back(host_clock::now());
+                        }
+                        break;
+                    case launch_mode::batched:
+                        enqueue(events);
+                        this->stream.sync();
+                        break;
+                    case launch_mode::graph: {
+                        this->stream.begin_capture();
+                        enqueue(events);
+                        const auto exec = this->stream.end_capture().instantiate();
+                        this->stream.launch(exec);
+                        this->stream.sync();
+                        break;
+                    }
+                }
+
+                const auto end = host_clock::now();
+                const auto to_host = [](auto d) {
+                    return std::chrono::duration_cast<host_clock::duration>(d);
+                };
+
+                for (size_t i = 0; i < n; ++i) {
+                    const auto& [start, stop] = events[i];
+                    const auto elapsed = std::chrono::duration_cast<duration>(gpu::event::elapsed(start, stop));
+                    durations.push_back(elapsed);
+
+                    if (!this->telemetry) {
+                        clock_rates.push_back(this->get_gpu_sclk_freq_mhz());
+                        continue;
+                    }
+
+                    // Reconstruct the host time window of the iteration, working backwards
+                    // from the moment the stream was synchronized.
+                    const auto stop_time = this->mode == launch_mode::serial
+                        ? synced[i]
+                        : end - to_host(gpu::event::elapsed(stop, events.back().second));
+                    if (const auto window = this->telemetry->window(stop_time - to_host(elapsed), stop_time)) {
+                        windows.push_back(*window);
+                    }
+                }
+            };
+
+            this->sample_all(sample, durations);
+
+            auto telemetry = std::optional<telemetry_stats>();
+            if (this->telemetry) {
+                if (windows.empty()) {
+                    // No samples at all, probably because the device does not support
+                    // reading the metrics.
+                    clock_rates.push_back(this->get_gpu_sclk_freq_mhz());
+                } else {
+                    telemetry = this->summarize_telemetry(windows, durations.size());
+                    clock_rates = std::vector<double>();
+                    for (const auto& window : windows) {
+                        if (!std::isnan(window.sclk_mhz)) {
+                            clock_rates.push_back(window.sclk_mhz);
+                        }
+                    }
+                    if (clock_rates.empty()) {
+                        clock_rates.push_back(this->get_gpu_sclk_freq_mhz());
+                    }
+                }
+            }
+
+            return {
+                .runtime = this->reject_outliers
+                    ? statistic<duration>::without_outliers(durations)
+                    : statistic(durations),
+                .clock_rate = statistic(clock_rates),
+                .median_ci = relative_median_ci(durations),
+                .counters = std::move(counters),
+                .telemetry = std::move(telemetry),
+                .cache = this->cache,
+                .flush = flush,
+            };
+        }
+
+        // Like bench(), but times `f` on the host rather than with events on the stream, so
+        // that the time to submit the work and to notice that it completed is included.
+        // `f` is responsible for waiting until its work has finished. The caches are not
+        // flushed, as that would end up in the measurement.
+        template <typename F>
+        benchmark_stats bench_host(F f) {
+            using host_clock = std::chrono::steady_clock;
+
+            for (int i = 0; i < this->warmups; ++i) {
+                f(this->stream);
             }
+            dev.sync();
+
+            auto durations = std::vector<duration>();
+            auto clock_rates = std::vector<double>();
+            const auto sample = [&](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                    const auto start = host_clock::now();
+                    f(this->stream);
+                    const auto stop = host_clock::now();
+                    durations.push_back(std::chrono::duration_cast<duration>(stop - start));
+                    clock_rates.push_back(this->get_gpu_sclk_freq_mhz());
+                }
+            };
+            this->sample_all(sample, durations);
 
             return {
-                .runtime = statistic(durations),
+                .runtime = this->reject_outliers
+                    ? statistic<duration>::without_outliers(durations)
+                    : statistic(durations),
                 .clock_rate = statistic(clock_rates),
+                .median_ci = relative_median_ci(durations),
+                .cache = cache_state::warm,
+            };
+        }
+
+        // Calls `sample(n)` to take n more samples, which it appends to `durations`, either
+        // for the configured number of iterations or until the adaptive criteria are met.
+        template <typename F>
+        void sample_all(F& sample, const std::vector<duration>& durations) {
+            if (!this->adaptive) {
+                sample(this->iterations);
+                return;
+            }
+
+            const auto& opts = *this->adaptive;
+            const auto deadline = std::chrono::steady_clock::now() + opts.time_budget;
+
+            sample(opts.min_iterations);
+            while (durations.size() < opts.max_iterations
+                && relative_median_ci(durations) > opts.target_ci
+                && std::chrono::steady_clock::now() < deadline
+            ) {
+                // Grow geometrically, so that the confidence interval doesn't need to be
+                // recomputed all the time for short kernels.
+                sample(std::min(std::max(opts.min_iterations, durations.size() / 4), opts.max_iterations - durations.size()));
+            }
+        }
+
+        telemetry_stats summarize_telemetry(const std::vector<telemetry_window>& windows, size_t iterations) const {
+            auto sclk = std::vector<double>();
+            auto mclk = std::vector<double>();
+            auto power = std::vector<double>();
+            auto temp = std::vector<double>();
+            size_t throttled = 0;
+            // Metrics that the device doesn't report are NaN. Leave them out, as they would
+            // break sorting in statistic, and only report a NaN if there is nothing else.
+            const auto add = [](std::vector<double>& values, double value) {
+                if (!std::isnan(value)) {
+                    values.push_back(value);
+                }
+            };
+            const auto stat = [](std::vector<double>& values) {
+                if (values.empty()) {
+                    values.push_back(std::nan(""));
+                }
+                return statistic(values);
+            };
+
+            for (const auto& window : windows) {
+                add(sclk, window.sclk_mhz);
+                add(mclk, window.mclk_mhz);
+                add(power, window.power_w);
+                add(temp, window.junction_temp_c);
+                throttled += window.throttled;
+            }
+
+            if (throttled > 0) {
+                this->log() << "  warning: " << throttled << " of " << iterations << " iterations ran while throttled\n";
+            }
+
+            return {
+                .sclk_mhz = stat(sclk),
+                .mclk_mhz = stat(mclk),
+                .power_w = stat(power),
+                .junction_temp_c = stat(temp),
+                .throttled_iterations = throttled,
+            };
+        }
+
+        // Collects the requested counters over `counter_launches` launches of `f`, and
+        // returns the average value per launch. Each launch is counted on its own, so that
+        // the cache flush is not included.
+        template <typename F>
+        counter_values collect_counters(F& f) {
+            auto collector = counter_collector(this->dev, this->counters);
+
+            auto totals = counter_values();
+            for (size_t i = 0; i < this->counter_launches; ++i) {
+                this->flush();
+                dev.sync();
+                collector.start();
+                f(this->stream);
+                dev.sync();
+                const auto values = collector.stop();
+
+                if (totals.empty()) {
+                    totals = values;
+                } else {
+                    for (size_t j = 0; j < values.size(); ++j) {
+                        totals[j].second += values[j].second;
+                    }
+                }
+            }
+
+            this->log() << "  counters:       ";
+            for (auto& [name, value] : totals) {
+                value /= this->counter_launches;
+                this->log() << " " << name << "=" << value;
+            }
+            this->log() << "\n";
+
+            return totals;
+        }
+
+        // Like bench(), but also collects the per-wave timestamps that the kernel writes
+        // using wave_timer. `f` is passed the stream and the timestamp buffer that the
+        // launch should write to, which needs to hold `waves` records.
+        template <typename F>
+        benchmark_stats bench_waves(size_t waves, F f) {
+            // Every timed launch gets its own slice of the buffer so that the records can
+            // all be read back at the end. We don't care about the warmups, those simply
+            // wrap around and are overwritten by the timed launches later. Kernels with many
+            // waves would need a huge buffer, so in that case only the last few launches
+            // are kept, and kernels that don't fit even once are rejected.
+            if (waves * sizeof(wave_timestamp) > max_timestamp_bytes) {
+                throw traced_error("the timestamps of {} waves don't fit in {} bytes", waves, max_timestamp_bytes);
+            }
+            const auto max_launches = this->adaptive ? this->adaptive->max_iterations : this->iterations;
+            const auto slots = std::clamp<size_t>(max_timestamp_bytes / (waves * sizeof(wave_timestamp)), 1, max_launches);
+            const auto timestamps = this->dev.alloc<wave_timestamp>(waves * slots);
+            this->stream.memset(timestamps.raw, 0x00, waves * slots * sizeof(wave_timestamp));
+
+            size_t launches = 0;
+            auto stats = this->bench([&](const auto& stream) {
+                f(stream, timestamps.raw + (launches++ % slots) * waves);
+            });
+
+            auto records = std::vector<wave_timestamp>(waves * slots);
+            this->stream.copy(records.data(), timestamps.raw, records.size() * sizeof(wave_timestamp));
+            this->stream.sync();
+
+            const auto ticks_to_duration = [&](uint64_t ticks) {
+                return duration(static_cast<double>(ticks) * 1'000'000 / this->dev.properties.wall_clock_rate_khz);
+            };
+
+            auto cycles = std::vector<double>();
+            cycles.reserve(records.size());
+            auto spans = std::vector<duration>();
+            spans.reserve(slots);
+            auto cu_cycles = std::vector<double>();
+
+            // Only look at the slots that were last written by a timed launch. In adaptive
+            // mode there may be fewer of those than there are slots. The timed launches are
+            // always the last ones.
+            const auto timed = std::min(slots, stats.runtime.samples + stats.runtime.outliers);
+            for (size_t i = 0; i < timed; ++i) {
+                const auto slot = (launches - 1 - i) % slots;
+                uint64_t first_start = std::numeric_limits<uint64_t>::max();
+                uint64_t last_stop = 0;
+                auto per_cu = std::unordered_map<uint32_t, double>();
+
+                for (const auto& record : std::span(records).subspan(slot * waves, waves)) {
+                    // Waves that did not write a record (for example, because the kernel
+                    // exited early) are simply ignored.
+                    if (record.stop == 0) {
+                        continue;
+                    }
+
+                    first_start = std::min(first_start, record.start);
+                    last_stop = std::max(last_stop, record.stop);
+                    cycles.push_back(record.cycles);
+                    per_cu[record.cu] += record.cycles;
+                }
+
+                if (last_stop != 0) {
+                    spans.push_back(ticks_to_duration(last_stop - first_start));
+                    for (const auto& [cu, total] : per_cu) {
+                        cu_cycles.push_back(total);
+                    }
+                }
+            }
+
+            if (cycles.empty()) {
+                throw traced_error("kernel did not write any wave timestamps");
+            }
+
+            stats.waves = wave_stats{
+                .cycles = statistic(cycles),
+                .span = statistic(spans),
+                .cu_cycles = statistic(cu_cycles),
             };
+            return stats;
         }
     };
 }
@@ -7,6 +7,13 @@
 #include <string>
 #include <cstdint>
 #include <vector>
+#include <optional>
+#include <string_view>
+#include <charconv>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
 
 struct traced_error: std::runtime_error {
     std::stacktrace trace;
@@ -39,6 +46,49 @@ struct pci_address {
     constexpr bool operator!=(const pci_address& other) const {
         return !(*this == other);
     }
+
+    // Parses an address in the form `domain:bus:device.function`, where the domain and
+    // function may be omitted, for example `0000:03:00.0` or `03:00`.
+    static std::optional<pci_address> parse(std::string_view str) {
+        const auto parse_hex = [&](std::string_view part, auto& value) {
+            uint32_t result;
+            const auto [end, ec] = std::from_chars(part.data(), part.data() + part.size(), result, 16);
+            using T = std::remove_reference_t<decltype(value)>;
+            if (part.empty() || ec != std::errc() || end != part.data() + part.size() || result > std::numeric_limits<T>::max()) {
+                return false;
+            }
+            value = static_cast<T>(result);
+            return true;
+        };
+
+        auto addr = pci_address{.domain = 0, .bus = 0, .device = 0, .function = 0};
+
+        if (const auto dot = str.rfind('.'); dot != std::string_view::npos) {
+            if (!parse_hex(str.substr(dot + 1), addr.function)) {
+                return std::nullopt;
+            }
+            str = str.substr(0, dot);
+        }
+
+        const auto last = str.rfind(':');
+        if (last == std::string_view::npos || !parse_hex(str.substr(last + 1), addr.device)) {
+            return std::nullopt;
+        }
+        str = str.substr(0, last);
+
+        if (const auto first = str.rfind(':'); first != std::string_view::npos) {
+            if (!parse_hex(str.substr(0, first), addr.domain)) {
+                return std::nullopt;
+            }
+            str = str.substr(first + 1);
+        }
+
+        if (!parse_hex(str, addr.bus)) {
+            return std::nullopt;
+        }
+
+        return addr;
+    }
 };
 
 template<>
@@ -61,16 +111,21 @@ struct std::formatter<pci_address, char> {
     }
 };
 
+// Computes the sample standard deviation, which is 0 for fewer than two items.
 template <typename T>
 struct stddev_helper {
     static T compute(const std::vector<T>& items, const T& average) {
+        if (items.size() < 2) {
+            return T{0};
+        }
+
         auto variance = T{0};
         for (const auto& item : items) {
             const auto diff = item - average;
             variance += diff * diff;
         }
 
-        return std::sqrt(variance);
+        return std::sqrt(variance / (items.size() - 1));
     }
 };
 
@@ -79,13 +134,17 @@ struct stddev_helper<std::chrono::duration<Rep, Period>> {
     using Item = std::chrono::duration<Rep, Period>;
 
     static Item compute(const std::vector<Item>& items, const Item& average) {
+        if (items.size() < 2) {
+            return Item(0);
+        }
+
         auto variance = Rep{0};
         for (const auto& item : items) {
             const auto diff = item.count() - average.count();
             variance += diff * diff;
         }
 
-        return Item(std::sqrt(variance));
+        return Item(std::sqrt(variance / (items.size() - 1)));
     }
 };
 
@@ -95,6 +154,13 @@ struct statistic {
     T stddev;
     T largest;
     T smallest;
+    T median;
+    T p05;
+    T p95;
+    // Number of items that the statistic was computed over.
+    size_t samples;
+    // Number of items that were discarded by without_outliers().
+    size_t outliers = 0;
 
     explicit statistic(const std::vector<T>& items) {
         this->largest = items[0];
@@ -110,6 +176,48 @@ struct statistic {
 
         this->average = total / items.size();
         this->stddev = stddev_helper<T>::compute(items, this->average);
+        this->samples = items.size();
+
+        auto sorted = items;
+        std::ranges::sort(sorted);
+        this->median = percentile(sorted, 0.5);
+        this->p05 = percentile(sorted, 0.05);
+        this->p95 = percentile(sorted, 0.95);
+    }
+
+    // Returns the p-th quantile (0 <= p <= 1) of `sorted`, interpolating linearly
+    // between the two closest items.
+    static T percentile(const std::vector<T>& sorted, double p) {
+        const auto rank = p * (sorted.size() - 1);
+        const auto lo = static_cast<size_t>(rank);
+        const auto hi = std::min(lo + 1, sorted.size() - 1);
+        return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+    }
+
+    // Computes the statistic over the items within Tukey's fences, that is, those that
+    // are at most 1.5 interquartile ranges below the first or above the third quartile.
+    // This drops the occasional sample that was disturbed by something else running on
+    // the system.
+    static statistic without_outliers(const std::vector<T>& items) {
+        auto sorted = items;
+        std::ranges::sort(sorted);
+        const auto q1 = percentile(sorted, 0.25);
+        const auto q3 = percentile(sorted, 0.75);
+        const auto iqr = q3 - q1;
+        const auto lower = q1 - iqr * 1.5;
+        const auto upper = q3 + iqr * 1.5;
+
+        auto kept = std::vector<T>();
+        kept.reserve(sorted.size());
+        for (const auto& item : sorted) {
+            if (item >= lower && item <= upper) {
+                kept.push_back(item);
+            }
+        }
+
+        auto result = statistic(kept);
+        result.outliers = items.size() - kept.size();
+        return result;
     }
 };
 
@@ -124,10 +232,11 @@ struct std::formatter<statistic<T>, char> {
     FmtContext::iterator format(const statistic<T>& stat, FmtContext& ctx) const {
         return std::format_to(
             ctx.out(),
-            "{} +- {}σ [min {}, max {}]",
+            "{} +- {}σ [min {}, median {}, max {}]",
             stat.average,
             stat.stddev,
             stat.smallest,
+            stat.median,
             stat.largest
         );
     }
@@ -0,0 +1,296 @@
+#ifndef _COUNTERS_HPP
+#define _COUNTERS_HPP
+
+#include "gpu.hpp"
+#include "common.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <span>
+
+#ifdef BENCHMARK_HAS_ROCPROFILER
+#include <rocprofiler-sdk/rocprofiler.h>
+#include <rocprofiler-sdk/registration.h>
+#endif
+
+namespace benchmark {
+    // Values of hardware performance counters, summed over all instances of the counter
+    // (shader engines, TCC channels, and so on).
+    using counter_values = std::vector<std::pair<std::string, double>>;
+
+#ifdef BENCHMARK_HAS_ROCPROFILER
+    struct counter_error: traced_error {
+        rocprofiler_status_t status;
+
+        explicit counter_error(rocprofiler_status_t status):
+            traced_error("{} ({})", rocprofiler_get_status_string(status), static_cast<int>(status)),
+            status(status)
+        {}
+    };
+
+    #define ROCPROFILER_TRY(expr) {                     \
+        const auto _result = (expr);                    \
+        if (_result != ROCPROFILER_STATUS_SUCCESS) {    \
+            throw ::benchmark::counter_error(_result);  \
+        }                                               \
+    }
+
+    // Collects device-wide counters through the rocprofiler-sdk device counting service.
+    // rocprofiler-sdk tools have to be registered before the HSA runtime is initialized,
+    // so initialize() must be called before any HIP functions are used. The service
+    // counts everything that runs on the device between start() and stop(), which is why
+    // the executor only collects counters around a single launch at a time.
+    struct counter_collector {
+        struct agent_state {
+            rocprofiler_agent_id_t agent;
+            pci_address pci_address;
+            rocprofiler_context_id_t context;
+            rocprofiler_buffer_id_t buffer;
+            // The counter configuration to use when the context is next started.
+            rocprofiler_counter_config_id_t config;
+            // Configurations are not released until the process exits, so one is created
+            // for every set of counters and reused by every collector of the same set.
+            std::map<std::vector<std::string>, rocprofiler_counter_config_id_t> configs;
+        };
+
+        static std::vector<agent_state>& agents() {
+            static auto state = std::vector<agent_state>();
+            return state;
+        }
+
+        static std::mutex& mutex() {
+            static auto m = std::mutex();
+            return m;
+        }
+
+        static bool& initialized() {
+            static bool value = false;
+            return value;
+        }
+
+        static void initialize() {
+            ROCPROFILER_TRY(rocprofiler_force_configure(&configure));
+            if (!initialized()) {
+                throw traced_error("failed to register with rocprofiler-sdk");
+            }
+        }
+
+        static bool available() {
+            return initialized();
+        }
+
+        agent_state* state;
+        // Counter ids in the same order as `names`.
+        std::vector<std::pair<rocprofiler_counter_id_t, std::string>> counters;
+        std::vector<rocprofiler_record_counter_t> records;
+
+        counter_collector(const gpu::device& dev, const std::vector<std::string>& names):
+            records(max_records)
+        {
+            if (!available()) {
+                throw traced_error("counter collection was not initialized");
+            }
+
+            const auto it = std::ranges::find_if(agents(), [&](const auto& a) {
+                return a.pci_address == dev.properties.pci_address;
+            });
+            if (it == agents().end()) {
+                throw traced_error("no rocprofiler agent for device {}", dev.properties.pci_address);
+            }
+            this->state = &*it;
+
+            auto supported = std::vector<std::pair<rocprofiler_counter_id_t, std::string>>();
+            ROCPROFILER_TRY(rocprofiler_iterate_agent_supported_counters(
+                this->state->agent,
+                [](rocprofiler_agent_id_t, rocprofiler_counter_id_t* ids, size_t count, void* data) {
+                    auto& supported = *static_cast<std::vector<std::pair<rocprofiler_counter_id_t, std::string>>*>(data);
+                    for (size_t i = 0; i < count; ++i) {
+                        rocprofiler_counter_info_v0_t info;
+                        if (rocprofiler_query_counter_info(ids[i], ROCPROFILER_COUNTER_INFO_VERSION_0, &info) == ROCPROFILER_STATUS_SUCCESS) {
+                            supported.emplace_back(ids[i], info.name);
+                        }
+                    }
+                    return ROCPROFILER_STATUS_SUCCESS;
+                },
+                &supported
+            ));
+
+            auto ids = std::vector<rocprofiler_counter_id_t>();
+            for (const auto& name : names) {
+                const auto counter = std::ranges::find_if(supported, [&](const auto& c) { return c.second == name; });
+                if (counter == supported.end()) {
+                    throw traced_error("counter '{}' is not supported on {}", name, dev.properties.arch_name);
+                }
+                this->counters.push_back(*counter);
+                ids.push_back(counter->first);
+            }
+
+            const auto lock = std::lock_guard(mutex());
+            auto config = this->state->configs.find(names);
+            if (config == this->state->configs.end()) {
+                auto id = rocprofiler_counter_config_id_t{};
+                ROCPROFILER_TRY(rocprofiler_create_counter_config(this->state->agent, ids.data(), ids.size(), &id));
+                config = this->state->configs.emplace(names, id).first;
+            }
+            this->state->config = config->second;
+        }
+
+        counter_collector(const counter_collector&) = delete;
+        counter_collector& operator=(const counter_collector&) = delete;
+
+        void start() {
+            ROCPROFILER_TRY(rocprofiler_start_context(this->state->context));
+        }
+
+        counter_values stop() {
+            size_t count = this->records.size();
+            ROCPROFILER_TRY(rocprofiler_sample_device_counting_service(
+                this->state->context,
+                {},
+                ROCPROFILER_COUNTER_FLAG_NONE,
+                this->records.data(),
+                &count
+            ));
+            ROCPROFILER_TRY(rocprofiler_stop_context(this->state->context));
+
+            auto values = counter_values();
+            for (const auto& [id, name] : this->counters) {
+                values.emplace_back(name, 0.0);
+            }
+
+            for (const auto& record : std::span(this->records).first(count)) {
+                rocprofiler_counter_id_t id;
+                ROCPROFILER_TRY(rocprofiler_query_record_counter_id(record.id, &id));
+                for (size_t i = 0; i < this->counters.size(); ++i) {
+                    if (this->counters[i].first.handle == id.handle) {
+                        values[i].second += record.counter_value;
+                    }
+                }
+            }
+
+            return values;
+        }
+
+    private:
+        static constexpr size_t max_records = 64 * 1024;
+
+        static void set_profile(
+            rocprofiler_context_id_t context,
+            rocprofiler_agent_id_t,
+            rocprofiler_agent_set_profile_callback_t set_config,
+            void* data
+        ) {
+            const auto& state = *static_cast<const agent_state*>(data);
+            set_config(context, state.config);
+        }
+
+        static int tool_init(rocprofiler_client_finalize_t, void*) {
+            auto gpus = std::vector<rocprofiler_agent_v0_t>();
+            const auto status = rocprofiler_query_available_agents(
+                ROCPROFILER_AGENT_INFO_VERSION_0,
+                [](rocprofiler_agent_version_t, const void** agents, size_t count, void* data) {
+                    auto& gpus = *static_cast<std::vector<rocprofiler_agent_v0_t>*>(data);
+                    for (size_t i = 0; i < count; ++i) {
+                        const auto* agent = static_cast<const rocprofiler_agent_v0_t*>(agents[i]);
+                        if (agent->type == ROCPROFILER_AGENT_TYPE_GPU) {
+                            gpus.push_back(*agent);
+                        }
+                    }
+                    return ROCPROFILER_STATUS_SUCCESS;
+                },
+                sizeof(rocprofiler_agent_v0_t),
+                &gpus
+            );
+            if (status != ROCPROFILER_STATUS_SUCCESS) {
+                return -1;
+            }
+
+            // Reserve up front: the states are passed to rocprofiler by pointer.
+            agents().reserve(gpus.size());
+            for (const auto& gpu : gpus) {
+                auto& state = agents().emplace_back(agent_state{
+                    .agent = gpu.id,
+                    // The location id uses the same encoding as the HSA BDF id.
+                    .pci_address = {
+                        .domain = static_cast<uint16_t>(gpu.domain & 0xFFFF),
+                        .bus = static_cast<uint8_t>((gpu.location_id >> 8) & 0xFF),
+                        .device = static_cast<uint8_t>((gpu.location_id >> 3) & 0x1F),
+                        .function = static_cast<uint8_t>(gpu.location_id & 0x7),
+                    },
+                    .context = {},
+                    .buffer = {},
+                    .config = {},
+                    .configs = {},
+                });
+
+                if (rocprofiler_create_context(&state.context) != ROCPROFILER_STATUS_SUCCESS) {
+                    return -1;
+                }
+
+                // Samples are read back synchronously in stop(), so nothing should ever
+                // end up in this buffer.
+                constexpr size_t buffer_size = 4096;
+                const auto buffer_status = rocprofiler_create_buffer(
+                    state.context,
+                    buffer_size,
+                    buffer_size / 2,
+                    ROCPROFILER_BUFFER_POLICY_LOSSLESS,
+                    [](rocprofiler_context_id_t, rocprofiler_buffer_id_t, rocprofiler_record_header_t**, size_t, void*, uint64_t) {},
+                    nullptr,
+                    &state.buffer
+                );
+                if (buffer_status != ROCPROFILER_STATUS_SUCCESS) {
+                    return -1;
+                }
+
+                if (rocprofiler_configure_device_counting_service(state.context, state.buffer, state.agent, set_profile, &state) != ROCPROFILER_STATUS_SUCCESS) {
+                    return -1;
+                }
+            }
+
+            initialized() = true;
+            return 0;
+        }
+
+        static void tool_fini(void*) {}
+
+        static rocprofiler_tool_configure_result_t* configure(uint32_t, const char*, uint32_t, rocprofiler_client_id_t* id) {
+            id->name = "gpu-experiments";
+            static auto result = rocprofiler_tool_configure_result_t{
+                .size = sizeof(rocprofiler_tool_configure_result_t),
+                .initialize = tool_init,
+                .finalize = tool_fini,
+                .tool_data = nullptr,
+            };
+            return &result;
+        }
+    };
+#else
+    // Stand-in for when the experiments are built without rocprofiler-sdk.
+    struct counter_collector {
+        static void initialize() {
+            throw traced_error("counter collection requires building with rocprofiler-sdk");
+        }
+
+        static bool available() {
+            return false;
+        }
+
+        counter_collector(const gpu::device&, const std::vector<std::string>&) {
+            initialize();
+        }
+
+        void start() {}
+
+        counter_values stop() {
+            return {};
+        }
+    };
+#endif
+}
+
+#endif
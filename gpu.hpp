@@ -9,6 +9,13 @@
 #include <format>
 #include <cstddef>
 #include <cassert>
+#include <vector>
+#include <string_view>
+#include <charconv>
+#include <cstdlib>
+#include <span>
+#include <bit>
+#include <type_traits>
 
 #define GPU_TRY(expr) {              \
     const auto _result = (expr);     \
@@ -24,7 +31,9 @@
     }                                    \
 }
 
-#if defined(__gfx942__) || defined(__gfx950__) || defined(__gfx9_4_generic__)
+#if defined(__gfx950__)
+    #define GPU_FAMILY_CDNA4
+#elif defined(__gfx942__) || defined(__gfx9_4_generic__)
     #define GPU_FAMILY_CDNA3
 #elif defined(__gfx90a__)
     #define GPU_FAMILY_CDNA2
@@ -76,15 +85,81 @@ namespace gpu {
         }
     };
 
+    // The different kinds of memory that a ptr can own.
+    enum class memory_kind {
+        // Device memory, from hipMalloc.
+        device,
+        // Device memory that is kept coherent with the host and other devices while kernels
+        // run, from hipExtMallocWithFlags with hipDeviceMallocFinegrained. Device memory is
+        // coarse-grained, and only made coherent at kernel boundaries.
+        fine_grained,
+        // Regular host memory, which the runtime has to stage through a pinned buffer.
+        pageable,
+        // Page-locked host memory, from hipHostMalloc. Kernels can also access this
+        // memory directly over the host link ("zero-copy").
+        pinned,
+        // Pageable host memory that is page-locked after the fact with hipHostRegister.
+        registered,
+        // Unified memory, from hipMallocManaged, which migrates on demand.
+        managed,
+    };
+
+    constexpr const char* memory_kind_name(memory_kind kind) {
+        switch (kind) {
+            case memory_kind::device: return "device";
+            case memory_kind::fine_grained: return "fine_grained";
+            case memory_kind::pageable: return "pageable";
+            case memory_kind::pinned: return "pinned";
+            case memory_kind::registered: return "registered";
+            case memory_kind::managed: return "managed";
+        }
+        return "unknown";
+    }
+
     template <typename T>
     struct ptr {
         friend struct device;
 
         T* raw;
+        memory_kind kind = memory_kind::device;
 
     private:
-        ptr(size_t size) {
-            GPU_TRY(hipMalloc(&this->raw, size * sizeof(T)));
+        // Host allocations are aligned to and padded to the page size, which is required
+        // for hipHostRegister.
+        static constexpr size_t host_alignment = 4096;
+
+        ptr(size_t size, memory_kind kind = memory_kind::device):
+            kind(kind)
+        {
+            const auto bytes = size * sizeof(T);
+            switch (kind) {
+                case memory_kind::device:
+                    GPU_TRY(hipMalloc(&this->raw, bytes));
+                    break;
+                case memory_kind::fine_grained:
+                    GPU_TRY(hipExtMallocWithFlags(reinterpret_cast<void**>(&this->raw), bytes, hipDeviceMallocFinegrained));
+                    break;
+                case memory_kind::pageable:
+                case memory_kind::registered:
+                    this->raw = static_cast<T*>(std::aligned_alloc(host_alignment, (bytes + host_alignment - 1) / host_alignment * host_alignment));
+                    if (!this->raw) {
+                        throw traced_error("failed to allocate {} bytes of host memory", bytes);
+                    }
+                    if (kind == memory_kind::registered) {
+                        const auto status = hipHostRegister(this->raw, bytes, hipHostRegisterMapped);
+                        if (status != hipSuccess) {
+                            std::free(this->raw);
+                            throw error(status);
+                        }
+                    }
+                    break;
+                case memory_kind::pinned:
+                    GPU_TRY(hipHostMalloc(&this->raw, bytes, hipHostMallocMapped));
+                    break;
+                case memory_kind::managed:
+                    GPU_TRY(hipMallocManaged(&this->raw, bytes));
+                    break;
+            }
         }
 
     public:
@@ -94,17 +169,137 @@ namespace gpu {
         ptr& operator=(const ptr&) = delete;
 
         ptr(ptr&& other):
-            raw(std::exchange(other.raw, nullptr))
+            raw(std::exchange(other.raw, nullptr)),
+            kind(other.kind)
         {}
 
         ptr& operator=(ptr&& other) {
             std::swap(this->raw, other.raw);
+            std::swap(this->kind, other.kind);
             return *this;
         }
 
         ~ptr() {
+            if (!this->raw) {
+                return;
+            }
+
+            switch (this->kind) {
+                case memory_kind::device:
+                case memory_kind::fine_grained:
+                case memory_kind::managed:
+                    (void) hipFree(this->raw);
+                    break;
+                case memory_kind::registered:
+                    (void) hipHostUnregister(this->raw);
+                    std::free(this->raw);
+                    break;
+                case memory_kind::pageable:
+                    std::free(this->raw);
+                    break;
+                case memory_kind::pinned:
+                    (void) hipHostFree(this->raw);
+                    break;
+            }
+        }
+
+        // Returns the address through which kernels can access this memory. This is
+        // only valid for memory that is accessible from the device.
+        T* device_address() const {
+            if (this->kind != memory_kind::pinned && this->kind != memory_kind::registered) {
+                return this->raw;
+            }
+            void* addr;
+            GPU_TRY(hipHostGetDevicePointer(&addr, this->raw, 0));
+            return static_cast<T*>(addr);
+        }
+    };
+
+    // Device memory that is backed by separate physical allocations of `chunk_size` bytes,
+    // which are mapped next to each other into a single range of virtual memory. The page
+    // tables can only use fragments as large as a physically contiguous range, so unlike
+    // with hipMalloc, this bounds the size of the translations that cover the memory. This
+    // relies on the driver placing the chunks physically apart, which it normally does but
+    // doesn't promise: neighbouring chunks that happen to be contiguous may share a fragment.
+    struct chunked_ptr {
+        friend struct device;
+
+        std::byte* raw = nullptr;
+        size_t size = 0;
+        size_t chunk_size = 0;
+        std::vector<hipMemGenericAllocationHandle_t> handles;
+
+    private:
+        chunked_ptr(int ordinal, size_t size, size_t chunk_size):
+            size(size),
+            chunk_size(chunk_size)
+        {
+            assert(size % chunk_size == 0);
+
+            hipMemAllocationProp prop = {};
+            prop.type = hipMemAllocationTypePinned;
+            prop.location.type = hipMemLocationTypeDevice;
+            prop.location.id = ordinal;
+
+            void* base;
+            GPU_TRY(hipMemAddressReserve(&base, size, chunk_size, nullptr, 0));
+            this->raw = static_cast<std::byte*>(base);
+
+            try {
+                this->handles.reserve(size / chunk_size);
+                for (size_t offset = 0; offset < size; offset += chunk_size) {
+                    hipMemGenericAllocationHandle_t handle;
+                    GPU_TRY(hipMemCreate(&handle, chunk_size, &prop, 0));
+                    const auto status = hipMemMap(this->raw + offset, chunk_size, 0, handle, 0);
+                    if (status != hipSuccess) {
+                        (void) hipMemRelease(handle);
+                        throw error(status);
+                    }
+                    this->handles.push_back(handle);
+                }
+
+                hipMemAccessDesc access = {};
+                access.location = prop.location;
+                access.flags = hipMemAccessFlagsProtReadWrite;
+                GPU_TRY(hipMemSetAccess(this->raw, size, &access, 1));
+            } catch (...) {
+                this->release();
+                throw;
+            }
+        }
+
+        void release() {
+            for (size_t i = 0; i < this->handles.size(); ++i) {
+                (void) hipMemUnmap(this->raw + i * this->chunk_size, this->chunk_size);
+                (void) hipMemRelease(this->handles[i]);
+            }
+            (void) hipMemAddressFree(this->raw, this->size);
+            this->handles.clear();
+            this->raw = nullptr;
+        }
+
+    public:
+        chunked_ptr(const chunked_ptr&) = delete;
+        chunked_ptr& operator=(const chunked_ptr&) = delete;
+
+        chunked_ptr(chunked_ptr&& other):
+            raw(std::exchange(other.raw, nullptr)),
+            size(other.size),
+            chunk_size(other.chunk_size),
+            handles(std::move(other.handles))
+        {}
+
+        chunked_ptr& operator=(chunked_ptr&& other) {
+            std::swap(this->raw, other.raw);
+            std::swap(this->size, other.size);
+            std::swap(this->chunk_size, other.chunk_size);
+            std::swap(this->handles, other.handles);
+            return *this;
+        }
+
+        ~chunked_ptr() {
             if (this->raw) {
-                (void) hipFree(this->raw);
+                this->release();
             }
         }
     };
@@ -149,6 +344,60 @@ namespace gpu {
         unsigned int shared_mem_per_block = 0;
     };
 
+    struct graph_exec {
+        hipGraphExec_t handle;
+
+        constexpr explicit graph_exec(hipGraphExec_t handle): handle(handle) {}
+
+        graph_exec(const graph_exec&) = delete;
+        graph_exec& operator=(const graph_exec&) = delete;
+
+        graph_exec(graph_exec&& other):
+            handle(std::exchange(other.handle, nullptr))
+        {}
+
+        graph_exec& operator=(graph_exec&& other) {
+            std::swap(this->handle, other.handle);
+            return *this;
+        }
+
+        ~graph_exec() {
+            if (this->handle) {
+                (void) hipGraphExecDestroy(this->handle);
+            }
+        }
+    };
+
+    struct graph {
+        hipGraph_t handle;
+
+        constexpr explicit graph(hipGraph_t handle): handle(handle) {}
+
+        graph(const graph&) = delete;
+        graph& operator=(const graph&) = delete;
+
+        graph(graph&& other):
+            handle(std::exchange(other.handle, nullptr))
+        {}
+
+        graph& operator=(graph&& other) {
+            std::swap(this->handle, other.handle);
+            return *this;
+        }
+
+        ~graph() {
+            if (this->handle) {
+                (void) hipGraphDestroy(this->handle);
+            }
+        }
+
+        graph_exec instantiate() const {
+            hipGraphExec_t exec;
+            GPU_TRY(hipGraphInstantiate(&exec, this->handle, nullptr, nullptr, 0));
+            return graph_exec(exec);
+        }
+    };
+
     struct stream {
         friend struct device;
 
@@ -166,6 +415,10 @@ namespace gpu {
             GPU_TRY(hipStreamCreateWithFlags(&this->handle, static_cast<unsigned int>(flags)));
         }
 
+        explicit stream(std::span<const uint32_t> cu_mask) {
+            GPU_TRY(hipExtStreamCreateWithCUMask(&this->handle, cu_mask.size(), cu_mask.data()));
+        }
+
         constexpr explicit stream(hipStream_t underlying): handle(underlying) {}
 
     public:
@@ -202,7 +455,32 @@ namespace gpu {
         }
 
         void memset(void* d_ptr, int ch, size_t count) const {
-            GPU_TRY(hipMemsetAsync(d_ptr, ch, count));
+            GPU_TRY(hipMemsetAsync(d_ptr, ch, count, this->handle));
+        }
+
+        void copy(void* dst, const void* src, size_t count) const {
+            GPU_TRY(hipMemcpyAsync(dst, src, count, hipMemcpyDefault, this->handle));
+        }
+
+        // Makes all future work on this stream wait until `event` has completed.
+        void wait(const event& event) const {
+            GPU_TRY(hipStreamWaitEvent(this->handle, event.handle, 0));
+        }
+
+        // Everything that is enqueued on the stream between begin_capture() and end_capture()
+        // is recorded into a graph instead of being executed.
+        void begin_capture() const {
+            GPU_TRY(hipStreamBeginCapture(this->handle, hipStreamCaptureModeThreadLocal));
+        }
+
+        graph end_capture() const {
+            hipGraph_t g;
+            GPU_TRY(hipStreamEndCapture(this->handle, &g));
+            return graph(g);
+        }
+
+        void launch(const graph_exec& exec) const {
+            GPU_TRY(hipGraphLaunch(exec.handle, this->handle));
         }
     };
 
@@ -220,8 +498,9 @@ namespace gpu {
             cdna1 = 0x20,
             cdna2 = 0x40,
             cdna3 = 0x80,
+            cdna4 = 0x100,
 
-            all = (cdna3 << 1) - 1
+            all = (cdna4 << 1) - 1
         };
 
         using backing_type = std::underlying_type_t<bits>;
@@ -307,6 +586,13 @@ namespace gpu {
             uint32_t simd_width;
             uint32_t cacheline_size;
             std::array<uint32_t, 4> cache_size;
+            // Frequency of the constant-rate counter returned by gpu::memrealtime().
+            uint32_t wall_clock_rate_khz;
+            // Amount of LDS that all blocks resident on a CU share, and the amount that a
+            // single block may allocate.
+            uint32_t lds_size_per_cu;
+            uint32_t max_lds_per_block;
+            uint32_t max_waves_per_cu;
 
             uint32_t total_simds() const {
                 return this->compute_units * this->simds_per_cu;
@@ -342,7 +628,20 @@ namespace gpu {
             this->properties.device_name = hip_props.name;
             this->properties.arch_name = hip_props.gcnArchName;
             this->properties.total_global_mem = hip_props.totalGlobalMem;
+            // HIP reports the default wave size of the device, even if the kernels were
+            // built for the other one. See the variants in CMakeLists.txt.
+#ifdef BENCHMARK_WAVE_SIZE
+            this->properties.warp_size = BENCHMARK_WAVE_SIZE;
+#else
             this->properties.warp_size = hip_props.warpSize;
+#endif
+
+            int wall_clock_rate_khz;
+            GPU_TRY(hipDeviceGetAttribute(&wall_clock_rate_khz, hipDeviceAttributeWallClockRate, this->hip_ordinal));
+            this->properties.wall_clock_rate_khz = wall_clock_rate_khz;
+
+            this->properties.lds_size_per_cu = hip_props.maxSharedMemoryPerMultiProcessor;
+            this->properties.max_lds_per_block = hip_props.sharedMemPerBlock;
 
             this->properties.pci_address = {
                 .domain = static_cast<uint16_t>(hip_props.pciDomainID),
@@ -390,16 +689,38 @@ namespace gpu {
             get_hsa_info(HSA_AMD_AGENT_INFO_NUM_SIMDS_PER_CU, this->properties.simds_per_cu);
             get_hsa_info(HSA_AMD_AGENT_INFO_CACHELINE_SIZE, this->properties.cacheline_size);
             get_hsa_info(HSA_AGENT_INFO_CACHE_SIZE, this->properties.cache_size);
+            get_hsa_info(HSA_AMD_AGENT_INFO_MAX_WAVES_PER_CU, this->properties.max_waves_per_cu);
         }
 
         void make_active() const {
             GPU_TRY(hipSetDevice(this->hip_ordinal));
         }
 
+        // Host memory kinds are not owned by the device, but they are still mapped into
+        // its address space.
         template <typename T>
-        ptr<T> alloc(size_t size) const {
+        ptr<T> alloc(size_t size, memory_kind kind = memory_kind::device) const {
             this->make_active();
-            return ptr<T>(size);
+            return ptr<T>(size, kind);
+        }
+
+        // Allocates `size` bytes of device memory in chunks of `chunk_size` bytes, see
+        // chunked_ptr. Both must be multiples of allocation_granularity().
+        chunked_ptr alloc_chunked(size_t size, size_t chunk_size) const {
+            this->make_active();
+            return chunked_ptr(this->hip_ordinal, size, chunk_size);
+        }
+
+        // The smallest chunk that device memory can be allocated in with alloc_chunked().
+        size_t allocation_granularity() const {
+            hipMemAllocationProp prop = {};
+            prop.type = hipMemAllocationTypePinned;
+            prop.location.type = hipMemLocationTypeDevice;
+            prop.location.id = this->hip_ordinal;
+
+            size_t granularity;
+            GPU_TRY(hipMemGetAllocationGranularity(&granularity, &prop, hipMemAllocationGranularityMinimum));
+            return granularity;
         }
 
         stream create_stream(stream::flags flags = stream::flags::default_flags) const {
@@ -407,6 +728,13 @@ namespace gpu {
             return stream(flags);
         }
 
+        // Creates a stream whose kernels only run on the CUs that are set in `cu_mask`,
+        // where bit i of word j stands for CU 32 * j + i.
+        stream create_stream(std::span<const uint32_t> cu_mask) const {
+            this->make_active();
+            return stream(cu_mask);
+        }
+
         family_set get_family() const {
             const auto arch_name = this->properties.arch_name;
             if (arch_name.starts_with("gfx12")) {
@@ -417,7 +745,9 @@ namespace gpu {
                 return family_set::rdna2;
             } else if (arch_name.starts_with("gfx101")) {
                 return family_set::rdna1;
-            } else if (arch_name.starts_with("gfx94") || arch_name.starts_with("gfx95")) {
+            } else if (arch_name.starts_with("gfx95")) {
+                return family_set::cdna4;
+            } else if (arch_name.starts_with("gfx94")) {
                 return family_set::cdna3;
             } else if (arch_name.starts_with("gfx90a")) {
                 return family_set::cdna2;
@@ -434,16 +764,90 @@ namespace gpu {
             this->make_active();
             GPU_TRY(hipDeviceSynchronize());
         }
+
+        // Returns the number of blocks of `kernel` that can be resident on a single CU at
+        // the same time, when launched with the given block size and dynamic LDS.
+        template <typename F>
+        uint32_t max_active_blocks_per_cu(F kernel, uint32_t block_size, size_t shared_mem_per_block = 0) const {
+            this->make_active();
+            int blocks;
+            GPU_TRY(hipOccupancyMaxActiveBlocksPerMultiprocessor(&blocks, kernel, block_size, shared_mem_per_block));
+            return blocks;
+        }
+
+        bool can_access_peer(const device& peer) const {
+            int can_access;
+            GPU_TRY(hipDeviceCanAccessPeer(&can_access, this->hip_ordinal, peer.hip_ordinal));
+            return can_access != 0;
+        }
+
+        // Allows kernels running on this device to access memory allocated on `peer`.
+        void enable_peer_access(const device& peer) const {
+            this->make_active();
+            const auto status = hipDeviceEnablePeerAccess(peer.hip_ordinal, 0);
+            if (status == hipErrorPeerAccessAlreadyEnabled) {
+                // Clear the sticky error so that it doesn't show up in the next GPU_TRY.
+                (void) hipGetLastError();
+            } else if (status != hipSuccess) {
+                throw error(status);
+            }
+        }
     };
 
+    static int device_count() {
+        int count;
+        GPU_TRY(hipGetDeviceCount(&count));
+        return count;
+    }
+
     static device get_default_device() {
         return device(0);
     }
 
+    static std::vector<device> get_all_devices() {
+        auto devices = std::vector<device>();
+        const auto count = device_count();
+        devices.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            devices.emplace_back(i);
+        }
+        return devices;
+    }
+
+    // Finds a device by either its HIP ordinal or its PCI address.
+    static device find_device(std::string_view spec) {
+        const auto count = device_count();
+
+        int ordinal;
+        const auto [end, ec] = std::from_chars(spec.data(), spec.data() + spec.size(), ordinal);
+        if (ec == std::errc() && end == spec.data() + spec.size()) {
+            if (ordinal < 0 || ordinal >= count) {
+                throw traced_error("device ordinal {} out of range, there are {} devices", ordinal, count);
+            }
+            return device(ordinal);
+        }
+
+        const auto addr = pci_address::parse(spec);
+        if (!addr) {
+            throw traced_error("invalid device '{}', expected an ordinal or a PCI address", spec);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            auto dev = device(i);
+            if (dev.properties.pci_address == *addr) {
+                return dev;
+            }
+        }
+
+        throw traced_error("no device with PCI address {}", *addr);
+    }
+
     __device__
     constexpr family_set get_device_family() {
         // See https://llvm.org/docs/AMDGPUUsage.html#instructions
-        #ifdef GPU_FAMILY_CDNA3
+        #ifdef GPU_FAMILY_CDNA4
+            return family_set::cdna4;
+        #elifdef GPU_FAMILY_CDNA3
             return family_set::cdna3;
         #elifdef GPU_FAMILY_CDNA2
             return family_set::cdna2;
@@ -472,6 +876,69 @@ namespace gpu {
     void do_not_optimize(T value) {
         asm volatile ("" :: "v"(value));
     }
+
+    // Emulates the atomic read-modify-write `*addr = op(*addr, data)` with a compare-and-swap
+    // loop. This is the fallback for operations that the hardware doesn't support natively.
+    // Returns the old value, like a returning atomic.
+    template <typename T, typename Op>
+    __device__ __forceinline__
+    T atomic_cas_loop(T* addr, T data, Op op) {
+        using bits = std::conditional_t<sizeof(T) == sizeof(uint64_t), uint64_t, uint32_t>;
+        static_assert(sizeof(T) == sizeof(bits));
+
+        auto* bits_addr = reinterpret_cast<bits*>(addr);
+        auto expected = __hip_atomic_load(bits_addr, __ATOMIC_RELAXED, __HIP_MEMORY_SCOPE_AGENT);
+        while (!__hip_atomic_compare_exchange_strong(
+            bits_addr,
+            &expected,
+            std::bit_cast<bits>(op(std::bit_cast<T>(expected), data)),
+            __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED,
+            __HIP_MEMORY_SCOPE_AGENT
+        )) {
+            // Someone else got there first, `expected` now holds their value.
+        }
+        return std::bit_cast<T>(expected);
+    }
+
+    // Reads the shader clock counter of the current wave (s_memtime). This counts at the
+    // actual shader clock, and is thus affected by clock changes.
+    __device__ __forceinline__
+    uint64_t memtime() {
+        #if defined(GPU_FAMILY_RDNA3) || defined(GPU_FAMILY_RDNA4)
+            // s_memtime was removed in gfx11, so read the SHADER_CYCLES register instead.
+            // Note that on gfx11 this register is only 20 bits wide, see memtime_mask().
+            return __builtin_readcyclecounter();
+        #else
+            return __builtin_amdgcn_s_memtime();
+        #endif
+    }
+
+    // Mask of the bits of memtime() that are actually valid. Differences between two
+    // memtime() values should be masked with this to deal with wrap-around.
+    __device__
+    constexpr uint64_t memtime_mask() {
+        #ifdef GPU_FAMILY_RDNA3
+            return (uint64_t{1} << 20) - 1;
+        #else
+            return ~uint64_t{0};
+        #endif
+    }
+
+    // Reads the constant-rate "real time" counter (s_memrealtime). The frequency of this
+    // counter is given by device::properties::wall_clock_rate_khz. Unlike memtime(), this
+    // counter is shared by the entire device, so it can be used to compare the time between
+    // waves on different CUs.
+    __device__ __forceinline__
+    uint64_t memrealtime() {
+        #if defined(GPU_FAMILY_RDNA3) || defined(GPU_FAMILY_RDNA4)
+            // s_memrealtime was removed in gfx11, so ask for the time via a message instead.
+            constexpr int msg_rtn_get_realtime = 0x83;
+            return __builtin_amdgcn_s_sendmsg_rtnl(msg_rtn_get_realtime);
+        #else
+            return __builtin_amdgcn_s_memrealtime();
+        #endif
+    }
 }
 
 #endif
@@ -0,0 +1,86 @@
+#ifndef _MEMORY_HPP
+#define _MEMORY_HPP
+
+#include "gpu.hpp"
+
+// Kernels of the memory experiment that other experiments reuse.
+namespace memory {
+    // Streams through `buffer` with non-temporal 128-bit loads. Every block reads
+    // block_dim * items_per_thread items of T, so the grid should be sized to cover the
+    // buffer. Every load of a wave covers wave size * 16 contiguous bytes, the next load
+    // of the lane is that many bytes further.
+    template<typename T, int block_dim, int items_per_thread>
+    __global__ __launch_bounds__(block_dim)
+    void load_kernel(T* __restrict__ buffer) {
+        constexpr const auto wim = warpSize;
+
+        const auto bid = blockIdx.x;
+        const auto tid = threadIdx.x;
+        const auto wid = tid / wim;
+        const auto lid = __lane_id();
+
+        auto offset = bid * block_dim * items_per_thread + wid * wim * items_per_thread + lid * 4;
+        const auto* ptr = buffer + offset;
+
+        #if defined(GPU_FAMILY_CDNA3) || defined(GPU_FAMILY_CDNA4)
+            #define ATTRS "nt"
+        #elifdef GPU_FAMILY_RDNA4
+            #define ATTRS "th:TH_LOAD_NT"
+        #else
+            #define ATTRS "glc slc"
+        #endif
+
+        #ifdef GPU_FAMILY_RDNA4
+            #define INST "global_load_b128"
+        #else
+            #define INST "global_load_dwordx4"
+        #endif
+
+        // Multiples of the bytes that one load of a wave covers.
+        #if __AMDGCN_WAVEFRONT_SIZE == 32
+            #define WAVE_LOAD_1 "512"
+            #define WAVE_LOAD_2 "1024"
+            #define WAVE_LOAD_3 "1536"
+            #define WAVE_LOAD_4 "2048"
+        #else
+            #define WAVE_LOAD_1 "1024"
+            #define WAVE_LOAD_2 "2048"
+            #define WAVE_LOAD_3 "3072"
+            #define WAVE_LOAD_4 "4096"
+        #endif
+
+        if constexpr (items_per_thread == 16) {
+            __uint128_t a, b, c, d;
+            asm volatile(
+                INST " %0, %4 off " ATTRS "\n\t"
+                INST " %1, %4 off offset:" WAVE_LOAD_1 " " ATTRS "\n\t"
+                INST " %2, %4 off offset:" WAVE_LOAD_2 " " ATTRS "\n\t"
+                INST " %3, %4 off offset:" WAVE_LOAD_3 " " ATTRS "\n\t"
+                "s_waitcnt vmcnt(0)"
+                : "=&v"(a), "=&v"(b), "=&v"(c), "=&v"(d)
+                : "v"(ptr)
+            );
+        } else if constexpr (items_per_thread == 32) {
+            __uint128_t a, b, c, d;
+            __uint128_t e, f, g, h;
+            asm volatile(
+                INST " %0, %8 off offset:-" WAVE_LOAD_4 " " ATTRS "\n\t"
+                INST " %1, %8 off offset:-" WAVE_LOAD_3 " " ATTRS "\n\t"
+                INST " %2, %8 off offset:-" WAVE_LOAD_2 " " ATTRS "\n\t"
+                INST " %3, %8 off offset:-" WAVE_LOAD_1 " " ATTRS "\n\t"
+                INST " %4, %8 off offset:0000 " ATTRS "\n\t"
+                INST " %5, %8 off offset:" WAVE_LOAD_1 " " ATTRS "\n\t"
+                INST " %6, %8 off offset:" WAVE_LOAD_2 " " ATTRS "\n\t"
+                INST " %7, %8 off offset:" WAVE_LOAD_3 " " ATTRS "\n\t"
+                "s_waitcnt vmcnt(0)"
+                : "=&v"(a), "=&v"(b), "=&v"(c), "=&v"(d), "=&v"(e), "=&v"(f), "=&v"(g), "=&v"(h)
+                // The fifth load, so that the offsets of all eight fit in the immediate.
+                : "v"(ptr + 16 * wim)
+            );
+        } else {
+            static_assert(false, "unreachable");
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef _MMA_HPP
+#define _MMA_HPP
+
+#include "gpu.hpp"
+#include "benchmark.hpp"
+
+#include <array>
+#include <optional>
+#include <string_view>
+
+// Kernels and peak numbers of the mma experiment that other experiments reuse.
+namespace mma {
+    using u32x2 = uint32_t __attribute__((ext_vector_type(2)));
+    using u32x4 = uint32_t __attribute__((ext_vector_type(4)));
+    using u32x8 = uint32_t __attribute__((ext_vector_type(8)));
+    using f32x4 = float __attribute__((ext_vector_type(4)));
+    using f32x8 = float __attribute__((ext_vector_type(8)));
+    using f32x16 = float __attribute__((ext_vector_type(16)));
+    using f16x4 = _Float16 __attribute__((ext_vector_type(4)));
+    using f16x8 = _Float16 __attribute__((ext_vector_type(8)));
+    using f16x16 = _Float16 __attribute__((ext_vector_type(16)));
+    using u16x16 = uint16_t __attribute__((ext_vector_type(16)));
+    using i32x4 = int32_t __attribute__((ext_vector_type(4)));
+    using f64x4 = double __attribute__((ext_vector_type(4)));
+
+    // Converts to a register of any type with an unspecified value, so that instructions
+    // can be issued without anything to compute their operands.
+    struct undef {
+        template <typename T>
+        __device__ __forceinline__
+        operator T() const {
+            T value;
+            asm volatile("" : "=v"(value));
+            return value;
+        }
+    };
+
+    constexpr auto cdna = gpu::family_set(gpu::family_set::cdna1) | gpu::family_set::cdna2 | gpu::family_set::cdna3 | gpu::family_set::cdna4;
+    constexpr auto cdna1_2 = gpu::family_set(gpu::family_set::cdna1) | gpu::family_set::cdna2;
+    constexpr auto cdna2_plus = gpu::family_set(gpu::family_set::cdna2) | gpu::family_set::cdna3 | gpu::family_set::cdna4;
+    constexpr auto cdna3_plus = gpu::family_set(gpu::family_set::cdna3) | gpu::family_set::cdna4;
+
+    constexpr int trials_per_thread = 256;
+
+    // Runs `f` trials_per_thread times in every thread. Kernels are only compiled for the
+    // given families.
+    template <gpu::family_set families, int block_size, typename F>
+    __global__ __launch_bounds__(block_size)
+    void test_kernel(F f) {
+        if constexpr (families.contains(gpu::get_device_family())) {
+            #pragma clang loop unroll(full)
+            for (int i = 0; i < trials_per_thread; ++i) {
+                f();
+            }
+        }
+    }
+
+    // Launch configuration of test_kernel, which should keep every SIMD busy.
+    constexpr int test_block_size = 1024;
+
+    inline gpu::launch_config test_config(const gpu::device& dev) {
+        return {
+            .grid_size = 32 * dev.properties.compute_units,
+            .block_size = test_block_size,
+        };
+    }
+
+    // Total number of instructions that a launch of test_kernel with test_config issues.
+    inline benchmark::size test_insts(const gpu::device& dev) {
+        const auto warps = test_block_size / dev.properties.warp_size;
+        return benchmark::size(trials_per_thread * warps * test_config(dev).grid_size);
+    }
+
+    // Theoretical dense matrix throughput per SIMD per cycle for every family and data
+    // type, derived from the peak numbers that AMD publishes for the flagship of every
+    // family. Sparse instructions count the operations of the equivalent dense
+    // instruction, and so have twice this peak.
+    struct peak {
+        gpu::family_set families;
+        const char* dtype;
+        double ops_per_simd_cycle;
+    };
+
+    constexpr auto peaks = std::to_array<peak>({
+        {gpu::family_set::cdna1, "f32", 64},
+        {gpu::family_set::cdna1, "f16", 256},
+        {gpu::family_set::cdna1, "bf16", 128},
+        {gpu::family_set::cdna1, "i8", 256},
+
+        {gpu::family_set::cdna2, "f64", 64},
+        {gpu::family_set::cdna2, "f32", 64},
+        {gpu::family_set::cdna2, "f16", 256},
+        {gpu::family_set::cdna2, "bf16", 256},
+        {gpu::family_set::cdna2, "i8", 256},
+
+        {gpu::family_set::cdna3, "f64", 64},
+        {gpu::family_set::cdna3, "f32", 64},
+        {gpu::family_set::cdna3, "xf32", 256},
+        {gpu::family_set::cdna3, "f16", 512},
+        {gpu::family_set::cdna3, "bf16", 512},
+        {gpu::family_set::cdna3, "fp8", 1024},
+        {gpu::family_set::cdna3, "i8", 1024},
+
+        {gpu::family_set::cdna4, "f64", 32},
+        {gpu::family_set::cdna4, "f32", 64},
+        {gpu::family_set::cdna4, "f16", 1024},
+        {gpu::family_set::cdna4, "bf16", 1024},
+        {gpu::family_set::cdna4, "fp8", 2048},
+        {gpu::family_set::cdna4, "i8", 2048},
+        {gpu::family_set::cdna4, "fp6", 4096},
+        {gpu::family_set::cdna4, "fp4", 4096},
+
+        {gpu::family_set::rdna3, "f16", 256},
+        {gpu::family_set::rdna3, "bf16", 256},
+        {gpu::family_set::rdna3, "i8", 256},
+        {gpu::family_set::rdna3, "i4", 512},
+
+        {gpu::family_set::rdna4, "f16", 512},
+        {gpu::family_set::rdna4, "bf16", 512},
+        {gpu::family_set::rdna4, "fp8", 1024},
+        {gpu::family_set::rdna4, "i8", 1024},
+        {gpu::family_set::rdna4, "i4", 2048},
+    });
+
+    // Returns the theoretical peak of `dev` for `dtype` in TOPS, at the given clock rate. The
+    // measured clock should be passed, so that the comparison says how well the matrix
+    // cores are used, rather than how high the card clocks.
+    inline std::optional<double> peak_tops(const gpu::device& dev, std::string_view dtype, double clock_mhz, bool sparse = false) {
+        for (const auto& p : peaks) {
+            if (p.families.contains(dev.get_family()) && p.dtype == dtype) {
+                return dev.properties.total_simds() * p.ops_per_simd_cycle * (sparse ? 2 : 1) * clock_mhz * 1'000'000 / 1e12;
+            }
+        }
+        return std::nullopt;
+    }
+}
+
+#endif
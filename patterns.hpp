@@ -0,0 +1,179 @@
+#ifndef _PATTERNS_HPP
+#define _PATTERNS_HPP
+
+#include "common.hpp"
+#include "benchmark.hpp"
+
+#include <vector>
+#include <string>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <functional>
+
+// Index streams for experiments that gather from or scatter to a table, so that access
+// patterns other than the ones that are easy to compute in a kernel can be measured. The
+// indices are generated on the host and then copied to the device in full.
+namespace patterns {
+    // Patterns are generated with a fixed seed, so that different runs access the same
+    // elements in the same order.
+    constexpr uint64_t pattern_seed = 0x5eed;
+
+    // Odd, so that multiplying with it permutes the indices of a power-of-two table. See
+    // `zipf()`.
+    constexpr uint64_t scatter_factor = 2654435761;
+
+    struct pattern {
+        // The kind of pattern, such as "strided" or "zipf".
+        std::string kind;
+        // Whatever sets this pattern apart from others of the same kind, such as the
+        // stride. These are reported along with the results.
+        std::vector<benchmark::parameter> parameters;
+        // Number of elements in the table that the indices refer to.
+        size_t elements;
+        std::vector<uint32_t> indices;
+
+        std::string label() const {
+            auto result = this->kind;
+            for (const auto& param : this->parameters) {
+                result += std::visit([&](const auto& v) { return std::format(" {}={}", param.name, v); }, param.value);
+            }
+            return result;
+        }
+    };
+
+    // Element i * stride, wrapping around the table.
+    inline pattern strided(size_t count, size_t elements, size_t stride) {
+        auto indices = std::vector<uint32_t>(count);
+        for (size_t i = 0; i < count; ++i) {
+            indices[i] = static_cast<uint32_t>(i * stride % elements);
+        }
+        return {"strided", {{"stride", stride}}, elements, std::move(indices)};
+    }
+
+    // Every element is equally likely.
+    inline pattern uniform(size_t count, size_t elements) {
+        auto rng = std::mt19937_64(pattern_seed);
+        auto dist = std::uniform_int_distribution<uint32_t>(0, elements - 1);
+        auto indices = std::vector<uint32_t>(count);
+        std::ranges::generate(indices, [&] { return dist(rng); });
+        return {"uniform", {}, elements, std::move(indices)};
+    }
+
+    // Runs of `block` consecutive elements that start at a random multiple of `block`, like
+    // the rows of an embedding table that are looked up in a random order.
+    inline pattern blocked_random(size_t count, size_t elements, size_t block) {
+        auto rng = std::mt19937_64(pattern_seed);
+        auto dist = std::uniform_int_distribution<size_t>(0, elements / block - 1);
+        auto indices = std::vector<uint32_t>(count);
+        size_t start = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (i % block == 0) {
+                start = dist(rng) * block;
+            }
+            indices[i] = static_cast<uint32_t>(start + i % block);
+        }
+        return {"blocked_random", {{"block", block}}, elements, std::move(indices)};
+    }
+
+    // The element of rank k is accessed with a probability proportional to 1 / k^exponent.
+    // Ranks are sampled with the rejection-inversion method of Hörmann and Derflinger,
+    // which doesn't need a table of the distribution. The ranks are then spread over the
+    // table, so that the hot elements don't all share the same few cache lines.
+    inline pattern zipf(size_t count, size_t elements, double exponent) {
+        assert(std::has_single_bit(elements));
+        assert(exponent > 0);
+
+        // (exp(x) - 1) / x and log(1 + x) / x, which are well-behaved around 0.
+        const auto expm1_over = [](double x) { return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1 + x / 2; };
+        const auto log1p_over = [](double x) { return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1 - x / 2; };
+
+        const auto h = [&](double x) { return std::exp(-exponent * std::log(x)); };
+        const auto h_integral = [&](double x) {
+            const auto log_x = std::log(x);
+            return expm1_over((1 - exponent) * log_x) * log_x;
+        };
+        const auto h_integral_inverse = [&](double x) {
+            const auto t = std::max(x * (1 - exponent), -1.0);
+            return std::exp(log1p_over(t) * x);
+        };
+
+        const auto n = static_cast<double>(elements);
+        const auto h_integral_x1 = h_integral(1.5) - 1;
+        const auto h_integral_n = h_integral(n + 0.5);
+        const auto s = 2 - h_integral_inverse(h_integral(2.5) - h(2));
+
+        auto rng = std::mt19937_64(pattern_seed);
+        auto dist = std::uniform_real_distribution<double>(0, 1);
+        const auto sample = [&]() -> uint64_t {
+            while (true) {
+                const auto u = h_integral_n + dist(rng) * (h_integral_x1 - h_integral_n);
+                const auto x = h_integral_inverse(u);
+                const auto k = std::clamp(std::floor(x + 0.5), 1.0, n);
+                if (k - x <= s || u >= h_integral(k + 0.5) - h(k)) {
+                    return static_cast<uint64_t>(k) - 1;
+                }
+            }
+        };
+
+        auto indices = std::vector<uint32_t>(count);
+        std::ranges::generate(indices, [&] {
+            return static_cast<uint32_t>(sample() * scatter_factor & (elements - 1));
+        });
+        return {"zipf", {{"exponent", exponent}}, elements, std::move(indices)};
+    }
+
+    // Reads the indices of a recorded trace from `path`, as whitespace-separated decimal
+    // numbers. The table is just large enough for the largest index.
+    inline pattern load_trace(const std::string& path) {
+        auto in = std::ifstream(path);
+        if (!in) {
+            throw traced_error("failed to open trace '{}'", path);
+        }
+
+        auto indices = std::vector<uint32_t>();
+        uint64_t index;
+        while (in >> index) {
+            if (index > std::numeric_limits<uint32_t>::max()) {
+                throw traced_error("index {} of trace '{}' does not fit in 32 bits", index, path);
+            }
+            indices.push_back(static_cast<uint32_t>(index));
+        }
+        if (!in.eof()) {
+            throw traced_error("failed to parse trace '{}' after {} indices", path, indices.size());
+        }
+        if (indices.empty()) {
+            throw traced_error("trace '{}' is empty", path);
+        }
+
+        const auto elements = static_cast<size_t>(std::ranges::max(indices)) + 1;
+        return {"trace", {{"file", path}}, elements, std::move(indices)};
+    }
+
+    // Generates a pattern when called. The indices of a pattern take a lot of memory, so
+    // these are used to only keep one pattern around at a time.
+    using pattern_generator = std::function<pattern()>;
+
+    // The patterns that are measured by default, from perfectly coalesced to entirely
+    // random. Every one of them has `count` indices into a table of `elements` elements,
+    // which must be a power of two.
+    inline std::vector<pattern_generator> default_patterns(size_t count, size_t elements) {
+        auto result = std::vector<pattern_generator>();
+        for (const size_t stride : {1, 2, 4, 16, 64, 256}) {
+            result.push_back([=] { return strided(count, elements, stride); });
+        }
+        for (const size_t block : {4, 16, 64}) {
+            result.push_back([=] { return blocked_random(count, elements, block); });
+        }
+        for (const double exponent : {0.5, 0.99, 1.5}) {
+            result.push_back([=] { return zipf(count, elements, exponent); });
+        }
+        result.push_back([=] { return uniform(count, elements); });
+        return result;
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _POINTER_CHASE_HPP
+#define _POINTER_CHASE_HPP
+
+#include "gpu.hpp"
+
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+#if defined(__GFX11__) || defined(__GFX12__)
+#define LOAD_B64 "global_load_b64"
+#else
+#define LOAD_B64 "global_load_dwordx2"
+#endif
+
+#if defined(__GFX12__)
+#define WAIT_LOAD "s_wait_loadcnt 0x0"
+#else
+#define WAIT_LOAD "s_waitcnt vmcnt(0)"
+#endif
+
+// Building blocks for experiments that measure load latency by following a chain of
+// dependent pointers through memory.
+namespace pointer_chase {
+    // The chain is shuffled with a fixed seed, so that different runs visit the nodes
+    // in the same order.
+    constexpr uint64_t chain_seed = 0x5eed;
+
+    // Writes the address of node order[i + 1] into node order[i], so that following the
+    // pointers from any node visits every node exactly once before returning to the start.
+    inline __global__ __launch_bounds__(256)
+    void link_kernel(std::byte* __restrict__ buffer, const uint32_t* __restrict__ order, uint32_t nodes, uint32_t stride) {
+        const auto i = blockIdx.x * blockDim.x + threadIdx.x;
+        if (i >= nodes) {
+            return;
+        }
+
+        const auto node = order[i];
+        const auto next = order[(i + 1) % nodes];
+        *reinterpret_cast<uint64_t*>(buffer + static_cast<size_t>(node) * stride) =
+            reinterpret_cast<uint64_t>(buffer + static_cast<size_t>(next) * stride);
+    }
+
+    inline __global__ __launch_bounds__(1)
+    void chase_kernel(uint64_t start, size_t steps) {
+        auto p = start;
+        for (size_t i = 0; i < steps; ++i) {
+            // Issue the load manually: the pointer is uniform, so the compiler would otherwise
+            // happily turn this into a scalar load, which goes through a different cache.
+            asm volatile(
+                LOAD_B64 " %0, %1, off\n\t"
+                WAIT_LOAD
+                : "=v"(p)
+                : "v"(p)
+                : "memory"
+            );
+        }
+        gpu::do_not_optimize(p);
+    }
+
+    // Links `nodes` nodes that are `stride` bytes apart in `buffer` into a single chain in
+    // random order, and returns the address of the first node. `buffer` may live on any
+    // device that `dev` can access.
+    inline uint64_t link(const gpu::device& dev, const gpu::stream& stream, std::byte* buffer, uint32_t nodes, uint32_t stride) {
+        auto order = std::vector<uint32_t>(nodes);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937_64(chain_seed));
+
+        const auto d_order = dev.alloc<uint32_t>(nodes);
+        stream.copy(d_order.raw, order.data(), nodes * sizeof(uint32_t));
+        stream.launch(
+            {.grid_size = (nodes + 255) / 256, .block_size = 256},
+            link_kernel,
+            buffer,
+            d_order.raw,
+            nodes,
+            stride
+        );
+        stream.sync();
+
+        return reinterpret_cast<uint64_t>(buffer + static_cast<size_t>(order[0]) * stride);
+    }
+}
+
+#endif
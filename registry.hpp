@@ -0,0 +1,391 @@
+#ifndef _REGISTRY_HPP
+#define _REGISTRY_HPP
+
+#include "gpu.hpp"
+#include "benchmark.hpp"
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <iterator>
+#include <algorithm>
+#include <optional>
+#include <chrono>
+#include <map>
+
+namespace benchmark {
+    struct test_case {
+        std::string experiment;
+        std::string name;
+        std::vector<std::string> tags;
+        std::function<void(executor&)> run;
+        // Hardware counters that explain the results of this test, which are collected
+        // when running with `--counters default`.
+        std::vector<std::string> counters;
+        // Tests that take long to run, such as sweeps, are only run when they are selected
+        // explicitly by a filter or tag.
+        bool run_by_default = true;
+
+        std::string full_name() const {
+            return this->experiment + "/" + this->name;
+        }
+    };
+
+    struct registry {
+        // The experiment that tests are currently being registered for.
+        std::string experiment;
+        std::vector<test_case> tests;
+
+        // Every test is automatically tagged with the name of its experiment. The returned
+        // reference can be used to set further properties of the test, but is invalidated
+        // by the next call.
+        test_case& add(std::string name, std::vector<std::string> tags, std::function<void(executor&)> run) {
+            tags.push_back(this->experiment);
+            return this->tests.emplace_back(test_case{
+                .experiment = this->experiment,
+                .name = std::move(name),
+                .tags = std::move(tags),
+                .run = std::move(run),
+            });
+        }
+    };
+
+    // Experiments register their tests by constructing one of these at namespace scope. The
+    // registration function is only called once the device is known, so that it can decide
+    // which tests are supported.
+    struct register_experiment {
+        using register_fn = void (*)(registry& reg, const gpu::device& dev);
+
+        const char* name;
+        register_fn fn;
+
+        register_experiment(const char* name, register_fn fn):
+            name(name),
+            fn(fn)
+        {
+            all().push_back(this);
+        }
+
+        register_experiment(const register_experiment&) = delete;
+        register_experiment& operator=(const register_experiment&) = delete;
+
+        static std::vector<const register_experiment*>& all() {
+            static auto experiments = std::vector<const register_experiment*>();
+            return experiments;
+        }
+    };
+
+    // Calls `f.template operator()<value>()` for each of the values. This is used to register
+    // every instantiation of a templated test, for example:
+    //
+    //   for_each_value<64, 128, 256>([&]<int block_size>() {
+    //       reg.add(std::format("load<{}>", block_size), {}, load<block_size>);
+    //   });
+    template <auto... values, typename F>
+    void for_each_value(F&& f) {
+        (f.template operator()<values>(), ...);
+    }
+
+    // Matches `str` against a shell-style pattern, where `*` matches any sequence of
+    // characters and `?` matches a single character.
+    inline bool glob_match(std::string_view pattern, std::string_view str) {
+        size_t p = 0;
+        size_t s = 0;
+        size_t star = std::string_view::npos;
+        size_t star_s = 0;
+
+        while (s < str.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == str[s])) {
+                ++p;
+                ++s;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+                star = p++;
+                star_s = s;
+            } else if (star != std::string_view::npos) {
+                p = star + 1;
+                s = ++star_s;
+            } else {
+                return false;
+            }
+        }
+
+        while (p < pattern.size() && pattern[p] == '*') {
+            ++p;
+        }
+
+        return p == pattern.size();
+    }
+
+    inline std::vector<std::string> split(std::string_view str, char sep) {
+        auto parts = std::vector<std::string>();
+        while (true) {
+            const auto i = str.find(sep);
+            if (!str.substr(0, i).empty()) {
+                parts.emplace_back(str.substr(0, i));
+            }
+            if (i == std::string_view::npos) {
+                break;
+            }
+            str = str.substr(i + 1);
+        }
+        return parts;
+    }
+
+    struct usage_error: traced_error {
+        using traced_error::traced_error;
+    };
+
+    struct options {
+        // Tests are selected if their name matches any of the filters (or if there are no
+        // filters), and if they have any of the tags (or if there are no tags).
+        std::vector<std::string> filters;
+        std::vector<std::string> tags;
+        size_t warmups = default_warmups;
+        size_t iterations = default_iterations;
+        // Set when sampling adaptively instead of for a fixed number of iterations.
+        std::optional<adaptive_options> adaptive;
+        bool reject_outliers = false;
+        launch_mode mode = launch_mode::serial;
+        cache_state cache = cache_state::memset;
+        // Period of the telemetry sampling, or zero to disable it. Sampling polls amdsmi on a
+        // host thread while the benchmarks run, so it is off unless asked for.
+        std::chrono::microseconds telemetry_period = std::chrono::microseconds(0);
+        // Hardware counters to collect, where "default" stands for the test's own counters.
+        std::vector<std::string> counters;
+        // Overrides BENCHMARK_RESULTS.
+        std::string output;
+        // Ordinals or PCI addresses of the devices to run on, or "all". Defaults to the
+        // first device.
+        std::vector<std::string> devices;
+        // Results of a previous run to compare with, see baseline.
+        std::string baseline;
+        // Slowdown relative to the baseline beyond which a significant difference counts
+        // as a regression.
+        double regression_threshold = 0.05;
+        // Results files to summarize instead of running any tests.
+        std::vector<std::string> summarize;
+        // Parameters of the tests, see executor::param().
+        std::map<std::string, std::string, std::less<>> params;
+        // Run on all selected devices at the same time, rather than one after the other.
+        bool concurrent = false;
+        bool list = false;
+        bool help = false;
+
+        static constexpr const char* usage =
+            "usage: {} [options]\n"
+            "options:\n"
+            "  --filter <patterns>   only run tests whose name matches any of the comma-separated\n"
+            "                        patterns, either as `name` or `experiment/name`\n"
+            "  --tags <tags>         only run tests that have any of the comma-separated tags;\n"
+            "                        some long-running tests, such as those tagged `sweep`,\n"
+            "                        only run when selected by --filter or --tags\n"
+            "  --warmups <n>         number of untimed launches per test (default {})\n"
+            "  --iterations <n>      number of timed launches per test (default {})\n"
+            "  --adaptive            sample until the median runtime is known precisely enough,\n"
+            "                        instead of for a fixed number of iterations\n"
+            "  --target-ci <frac>    with --adaptive, stop once the 95% confidence interval of the\n"
+            "                        median is within this fraction of it (default {})\n"
+            "  --time-budget <ms>    with --adaptive, stop sampling a test after this many\n"
+            "                        milliseconds (default {})\n"
+            "  --reject-outliers     ignore samples outside of Tukey's fences\n"
+            "  --mode <mode>         how timed launches are issued: `serial` synchronizes around\n"
+            "                        every launch, `batched` enqueues all of them at once, and\n"
+            "                        `graph` replays them from a HIP graph (default serial)\n"
+            "  --cache-state <state> what the caches hold at the start of every timed launch:\n"
+            "                        `memset` or `read` evict them by writing or reading a buffer\n"
+            "                        the size of the largest cache, `invalidate` only invalidates\n"
+            "                        the caches in front of the L2, and `warm` doesn't flush at\n"
+            "                        all (default memset)\n"
+            "  --telemetry <us>      sample clocks, power and temperature at this period in\n"
+            "                        microseconds while benchmarks run, which may perturb\n"
+            "                        their timing (default off)\n"
+            "  --counters <names>    collect the comma-separated hardware counters for every\n"
+            "                        benchmark, `default` selects the counters of the test\n"
+            "  --output <file>       write results to <file> as JSON Lines, or CSV if the name\n"
+            "                        ends in .csv\n"
+            "  --baseline <file>     compare the results with those in <file>, as written by\n"
+            "                        --output in JSON Lines format, and exit with status 2 if\n"
+            "                        any test got significantly slower\n"
+            "  --regression-threshold <frac>\n"
+            "                        with --baseline, only count slowdowns of the median runtime\n"
+            "                        beyond this fraction as regressions (default {})\n"
+            "  --device <devices>    run on the comma-separated devices, given by ordinal or PCI\n"
+            "                        address, or on every device with `all`\n"
+            "  --param <key>=<value> set a parameter of the tests, may be given more than once;\n"
+            "                        cache_coalescing gathers and scatters the indices in\n"
+            "                        `trace=<file>` along with its own patterns\n"
+            "  --summarize <files>   instead of running any tests, print the median runtimes of the\n"
+            "                        comma-separated JSON Lines results files side by side for\n"
+            "                        every variant of the build, such as wave64 and cumode\n"
+            "  --concurrent          run on all selected devices at the same time\n"
+            "  --list                list the selected tests instead of running them\n"
+            "  --help                show this message\n";
+
+        static options parse(int argc, char* argv[]) {
+            auto opts = options();
+
+            for (int i = 1; i < argc; ++i) {
+                const auto arg = std::string_view(argv[i]);
+
+                const auto value = [&]() {
+                    if (i + 1 >= argc) {
+                        throw usage_error("missing value for option '{}'", arg);
+                    }
+                    return std::string_view(argv[++i]);
+                };
+
+                const auto count = [&]() {
+                    const auto str = value();
+                    size_t result;
+                    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), result);
+                    if (ec != std::errc() || end != str.data() + str.size()) {
+                        throw usage_error("invalid value '{}' for option '{}'", str, arg);
+                    }
+                    return result;
+                };
+
+                const auto fraction = [&]() {
+                    const auto str = value();
+                    double result;
+                    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), result);
+                    if (ec != std::errc() || end != str.data() + str.size() || result <= 0) {
+                        throw usage_error("invalid value '{}' for option '{}'", str, arg);
+                    }
+                    return result;
+                };
+
+                const auto adaptive = [&]() -> adaptive_options& {
+                    if (!opts.adaptive) {
+                        opts.adaptive = adaptive_options();
+                    }
+                    return *opts.adaptive;
+                };
+
+                if (arg == "--filter") {
+                    std::ranges::move(split(value(), ','), std::back_inserter(opts.filters));
+                } else if (arg == "--tags") {
+                    std::ranges::move(split(value(), ','), std::back_inserter(opts.tags));
+                } else if (arg == "--warmups") {
+                    opts.warmups = count();
+                } else if (arg == "--iterations") {
+                    opts.iterations = count();
+                    if (opts.iterations == 0) {
+                        throw usage_error("--iterations must be at least 1");
+                    }
+                } else if (arg == "--adaptive") {
+                    adaptive();
+                } else if (arg == "--target-ci") {
+                    adaptive().target_ci = fraction();
+                } else if (arg == "--time-budget") {
+                    adaptive().time_budget = std::chrono::milliseconds(count());
+                } else if (arg == "--reject-outliers") {
+                    opts.reject_outliers = true;
+                } else if (arg == "--mode") {
+                    const auto str = value();
+                    const auto mode = parse_launch_mode(str);
+                    if (!mode) {
+                        throw usage_error("invalid launch mode '{}'", str);
+                    }
+                    opts.mode = *mode;
+                } else if (arg == "--cache-state") {
+                    const auto str = value();
+                    const auto cache = parse_cache_state(str);
+                    if (!cache) {
+                        throw usage_error("invalid cache state '{}'", str);
+                    }
+                    opts.cache = *cache;
+                } else if (arg == "--telemetry") {
+                    opts.telemetry_period = std::chrono::microseconds(count());
+                } else if (arg == "--counters") {
+                    std::ranges::move(split(value(), ','), std::back_inserter(opts.counters));
+                } else if (arg == "--output") {
+                    opts.output = value();
+                } else if (arg == "--baseline") {
+                    opts.baseline = value();
+                } else if (arg == "--regression-threshold") {
+                    opts.regression_threshold = fraction();
+                } else if (arg == "--device") {
+                    std::ranges::move(split(value(), ','), std::back_inserter(opts.devices));
+                } else if (arg == "--param") {
+                    const auto str = value();
+                    const auto eq = str.find('=');
+                    if (eq == std::string_view::npos || eq == 0) {
+                        throw usage_error("invalid parameter '{}', expected <key>=<value>", str);
+                    }
+                    opts.params.insert_or_assign(std::string(str.substr(0, eq)), std::string(str.substr(eq + 1)));
+                } else if (arg == "--summarize") {
+                    std::ranges::move(split(value(), ','), std::back_inserter(opts.summarize));
+                } else if (arg == "--concurrent") {
+                    opts.concurrent = true;
+                } else if (arg == "--list") {
+                    opts.list = true;
+                } else if (arg == "--help" || arg == "-h") {
+                    opts.help = true;
+                } else {
+                    throw usage_error("unknown option '{}'", arg);
+                }
+            }
+
+            return opts;
+        }
+
+        std::vector<gpu::device> select_devices() const {
+            if (this->devices.empty()) {
+                return {gpu::get_default_device()};
+            }
+
+            auto selected = std::vector<gpu::device>();
+            for (const auto& spec : this->devices) {
+                if (spec == "all") {
+                    return gpu::get_all_devices();
+                }
+
+                auto dev = gpu::find_device(spec);
+                const bool duplicate = std::ranges::any_of(selected, [&](const auto& other) {
+                    return other.hip_ordinal == dev.hip_ordinal;
+                });
+                if (!duplicate) {
+                    selected.push_back(std::move(dev));
+                }
+            }
+            return selected;
+        }
+
+        // Returns the counters to collect for `test`.
+        std::vector<std::string> counters_for(const test_case& test) const {
+            auto result = std::vector<std::string>();
+            const auto add = [&](const std::string& name) {
+                if (std::ranges::find(result, name) == result.end()) {
+                    result.push_back(name);
+                }
+            };
+
+            for (const auto& name : this->counters) {
+                if (name == "default") {
+                    std::ranges::for_each(test.counters, add);
+                } else {
+                    add(name);
+                }
+            }
+            return result;
+        }
+
+        bool selects(const test_case& test) const {
+            const auto full_name = test.full_name();
+            const bool name_matches = this->filters.empty() || std::ranges::any_of(this->filters, [&](const auto& filter) {
+                return glob_match(filter, test.name) || glob_match(filter, full_name);
+            });
+            const bool tag_matches = this->tags.empty() || std::ranges::any_of(this->tags, [&](const auto& tag) {
+                return std::ranges::find(test.tags, tag) != test.tags.end();
+            });
+            if (!test.run_by_default && this->filters.empty() && this->tags.empty()) {
+                return false;
+            }
+            return name_matches && tag_matches;
+        }
+    };
+}
+
+#endif
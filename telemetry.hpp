@@ -0,0 +1,154 @@
+#ifndef _TELEMETRY_HPP
+#define _TELEMETRY_HPP
+
+#include "common.hpp"
+
+#include <amd_smi/amdsmi.h>
+
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+namespace benchmark {
+    struct telemetry_sample {
+        std::chrono::steady_clock::time_point time;
+        double sclk_mhz;
+        double mclk_mhz;
+        double power_w;
+        double junction_temp_c;
+        // Whether the SMU reported any throttling reason at the time of the sample.
+        bool throttled;
+    };
+
+    // Telemetry averaged over the window of a single iteration.
+    struct telemetry_window {
+        double sclk_mhz;
+        double mclk_mhz;
+        double power_w;
+        double junction_temp_c;
+        bool throttled;
+    };
+
+    struct telemetry_stats {
+        statistic<double> sclk_mhz;
+        statistic<double> mclk_mhz;
+        statistic<double> power_w;
+        statistic<double> junction_temp_c;
+        // Number of timed iterations during which the device reported throttling.
+        size_t throttled_iterations;
+    };
+
+    // Samples the clocks, power and temperature of a device on a background thread, so
+    // that they can later be correlated with the time window of each iteration.
+    struct telemetry_sampler {
+        using clock = std::chrono::steady_clock;
+
+        amdsmi_processor_handle handle;
+        std::chrono::microseconds period;
+        mutable std::mutex mutex;
+        std::vector<telemetry_sample> samples;
+        // Declared last, so that the thread is stopped before the rest is destroyed.
+        std::jthread thread;
+
+        telemetry_sampler(amdsmi_processor_handle handle, std::chrono::microseconds period):
+            handle(handle),
+            period(period),
+            thread([this](std::stop_token stop) { this->run(stop); })
+        {}
+
+        telemetry_sampler(const telemetry_sampler&) = delete;
+        telemetry_sampler& operator=(const telemetry_sampler&) = delete;
+
+        // Drops all samples taken so far.
+        void clear() {
+            const auto lock = std::lock_guard(this->mutex);
+            this->samples.clear();
+        }
+
+        // Returns the telemetry during [start, stop]. If the window is shorter than the
+        // sampling period, the sample closest to it is used instead.
+        std::optional<telemetry_window> window(clock::time_point start, clock::time_point stop) const {
+            const auto lock = std::lock_guard(this->mutex);
+            if (this->samples.empty()) {
+                return std::nullopt;
+            }
+
+            // Samples are taken in order, so they are sorted by time.
+            auto first = std::ranges::lower_bound(this->samples, start, {}, &telemetry_sample::time);
+            auto last = std::ranges::upper_bound(this->samples, stop, {}, &telemetry_sample::time);
+
+            if (first == last) {
+                const auto mid = start + (stop - start) / 2;
+                if (first == this->samples.end() || (first != this->samples.begin() && mid - std::prev(first)->time < first->time - mid)) {
+                    --first;
+                }
+                // Don't use samples that are far away from the window, those would say
+                // nothing about this iteration.
+                const auto distance = first->time > mid ? first->time - mid : mid - first->time;
+                if (distance > 2 * this->period) {
+                    return std::nullopt;
+                }
+                last = std::next(first);
+            }
+
+            auto result = telemetry_window{};
+            const auto n = static_cast<double>(last - first);
+            for (auto it = first; it != last; ++it) {
+                result.sclk_mhz += it->sclk_mhz / n;
+                result.mclk_mhz += it->mclk_mhz / n;
+                result.power_w += it->power_w / n;
+                result.junction_temp_c += it->junction_temp_c / n;
+                result.throttled = result.throttled || it->throttled;
+            }
+            return result;
+        }
+
+    private:
+        void run(std::stop_token stop) {
+            while (!stop.stop_requested()) {
+                const auto next = clock::now() + this->period;
+
+                amdsmi_gpu_metrics_t metrics;
+                if (amdsmi_get_gpu_metrics_info(this->handle, &metrics) == AMDSMI_STATUS_SUCCESS) {
+                    const auto sample = telemetry_sample{
+                        .time = clock::now(),
+                        .sclk_mhz = field(metrics.current_gfxclk),
+                        .mclk_mhz = field(metrics.current_uclk),
+                        .power_w = field(metrics.current_socket_power),
+                        .junction_temp_c = field(metrics.temperature_hotspot),
+                        .throttled = throttled(metrics),
+                    };
+
+                    const auto lock = std::lock_guard(this->mutex);
+                    this->samples.push_back(sample);
+                }
+
+                std::this_thread::sleep_until(next);
+            }
+        }
+
+        // Fields that the device does not support are set to all ones.
+        template <typename T>
+        static double field(T value) {
+            if (value == std::numeric_limits<T>::max()) {
+                return std::nan("");
+            }
+            return static_cast<double>(value);
+        }
+
+        static bool throttled(const amdsmi_gpu_metrics_t& metrics) {
+            const auto supported = [](auto value) {
+                return value != std::numeric_limits<decltype(value)>::max();
+            };
+            return (supported(metrics.throttle_status) && metrics.throttle_status != 0)
+                || (supported(metrics.indep_throttle_status) && metrics.indep_throttle_status != 0);
+        }
+    };
+}
+
+#endif
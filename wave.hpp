@@ -0,0 +1,211 @@
+#ifndef _WAVE_HPP
+#define _WAVE_HPP
+
+#include "gpu.hpp"
+
+// Wave-level collectives on 32-bit integers. Every implementation uses only one kind of
+// cross-lane primitive where it can. That way the primitives are compared on whole
+// operations as we ship them, and not only on single instructions (see the shuffle
+// experiment).
+namespace wave {
+    enum class primitive {
+        dpp,
+        ds_swizzle,
+        ds_bpermute,
+        readlane,
+    };
+
+    constexpr const char* primitive_name(primitive p) {
+        switch (p) {
+            case primitive::dpp: return "dpp";
+            case primitive::ds_swizzle: return "ds_swizzle";
+            case primitive::ds_bpermute: return "ds_bpermute";
+            case primitive::readlane: return "readlane";
+        }
+        return "unknown";
+    }
+
+    // Families that have the DPP row broadcasts (row_bcast:15 and row_bcast:31). RDNA
+    // dropped those, and moves data between rows with v_permlanex16 instead.
+    constexpr auto has_row_bcast = gpu::family_set(gpu::family_set::gcn5)
+        | gpu::family_set::cdna1
+        | gpu::family_set::cdna2
+        | gpu::family_set::cdna3
+        | gpu::family_set::cdna4;
+
+    namespace detail {
+        // See https://llvm.org/docs/AMDGPUModifierSyntax.html#dpp-ctrl
+        constexpr int dpp_quad_perm(int l0, int l1, int l2, int l3) {
+            return l0 | (l1 << 2) | (l2 << 4) | (l3 << 6);
+        }
+
+        constexpr int dpp_row_shr(int n) {
+            return 0x110 + n;
+        }
+
+        constexpr int dpp_row_mirror = 0x140;
+        constexpr int dpp_row_half_mirror = 0x141;
+        constexpr int dpp_row_bcast15 = 0x142;
+        constexpr int dpp_row_bcast31 = 0x143;
+
+        // Lanes that read outside of their row, and rows that are not in `row_mask`, get 0.
+        template <int ctrl, int row_mask = 0xf>
+        __device__ __forceinline__
+        int dpp(int x) {
+            return __builtin_amdgcn_update_dpp(0, x, ctrl, row_mask, 0xf, false);
+        }
+
+        // ds_swizzle in bitmask mode: every lane reads from lane
+        // ((lane & and_mask) | or_mask) ^ xor_mask of its group of 32 lanes.
+        template <int and_mask, int or_mask, int xor_mask>
+        __device__ __forceinline__
+        int swizzle(int x) {
+            return __builtin_amdgcn_ds_swizzle(x, and_mask | (or_mask << 5) | (xor_mask << 10));
+        }
+
+        __device__ __forceinline__
+        int bpermute(int x, int lane) {
+            return __builtin_amdgcn_ds_bpermute(lane * 4, x);
+        }
+
+        // DPP and ds_swizzle don't cross the halves of a wave64. For those, the halves are
+        // combined with readlane.
+        __device__ __forceinline__
+        int reduce_halves(int x) {
+            if constexpr (warpSize == 64) {
+                return __builtin_amdgcn_readlane(x, 0) + __builtin_amdgcn_readlane(x, 32);
+            }
+            return x;
+        }
+
+        __device__ __forceinline__
+        int scan_halves(int x) {
+            if constexpr (warpSize == 64) {
+                const auto carry = __builtin_amdgcn_readlane(x, 31);
+                return x + (__lane_id() >= 32 ? carry : 0);
+            }
+            return x;
+        }
+    }
+
+    // Returns the sum of `x` over all lanes, in every lane.
+    template <primitive p>
+    __device__ __forceinline__
+    int reduce(int x) {
+        using namespace detail;
+
+        if constexpr (p == primitive::dpp) {
+            // Every step combines two groups of lanes that already hold the same value.
+            x += dpp<dpp_quad_perm(1, 0, 3, 2)>(x);
+            x += dpp<dpp_quad_perm(2, 3, 0, 1)>(x);
+            x += dpp<dpp_row_half_mirror>(x);
+            x += dpp<dpp_row_mirror>(x);
+            if constexpr (has_row_bcast.contains(gpu::get_device_family())) {
+                x += dpp<dpp_row_bcast15, 0xa>(x);
+                x += dpp<dpp_row_bcast31, 0xc>(x);
+                return __builtin_amdgcn_readlane(x, 63);
+            } else {
+                x += __builtin_amdgcn_permlanex16(x, x, 0x76543210, 0xfedcba98, false, false);
+                return reduce_halves(x);
+            }
+        } else if constexpr (p == primitive::ds_swizzle) {
+            x += swizzle<0x1f, 0, 1>(x);
+            x += swizzle<0x1f, 0, 2>(x);
+            x += swizzle<0x1f, 0, 4>(x);
+            x += swizzle<0x1f, 0, 8>(x);
+            x += swizzle<0x1f, 0, 16>(x);
+            return reduce_halves(x);
+        } else if constexpr (p == primitive::ds_bpermute) {
+            const auto lane = static_cast<int>(__lane_id());
+            #pragma unroll
+            for (int mask = 1; mask < warpSize; mask <<= 1) {
+                x += bpermute(x, lane ^ mask);
+            }
+            return x;
+        } else if constexpr (p == primitive::readlane) {
+            int sum = 0;
+            #pragma unroll
+            for (int i = 0; i < warpSize; ++i) {
+                sum += __builtin_amdgcn_readlane(x, i);
+            }
+            return sum;
+        } else {
+            static_assert(false, "unreachable");
+        }
+    }
+
+    // Returns the inclusive prefix sum of `x` over the lanes.
+    template <primitive p>
+    __device__ __forceinline__
+    int scan(int x) {
+        using namespace detail;
+
+        const auto lane = static_cast<int>(__lane_id());
+        if constexpr (p == primitive::dpp) {
+            x += dpp<dpp_row_shr(1)>(x);
+            x += dpp<dpp_row_shr(2)>(x);
+            x += dpp<dpp_row_shr(4)>(x);
+            x += dpp<dpp_row_shr(8)>(x);
+            if constexpr (has_row_bcast.contains(gpu::get_device_family())) {
+                x += dpp<dpp_row_bcast15, 0xa>(x);
+                x += dpp<dpp_row_bcast31, 0xc>(x);
+                return x;
+            } else {
+                // Every lane gets the last lane of the other row.
+                const auto carry = __builtin_amdgcn_permlanex16(x, x, 0xffffffff, 0xffffffff, false, false);
+                x += (lane & 16) ? carry : 0;
+                return scan_halves(x);
+            }
+        } else if constexpr (p == primitive::ds_swizzle) {
+            // Every step adds the last lane of the lower half of every group of 2 * s
+            // lanes to the upper half. The swizzles run in every lane, as the lanes that
+            // they read from are the ones that don't add anything.
+            const auto s1 = swizzle<0x1e, 0x0, 0>(x);
+            x += (lane & 1) ? s1 : 0;
+            const auto s2 = swizzle<0x1c, 0x1, 0>(x);
+            x += (lane & 2) ? s2 : 0;
+            const auto s4 = swizzle<0x18, 0x3, 0>(x);
+            x += (lane & 4) ? s4 : 0;
+            const auto s8 = swizzle<0x10, 0x7, 0>(x);
+            x += (lane & 8) ? s8 : 0;
+            const auto s16 = swizzle<0x00, 0xf, 0>(x);
+            x += (lane & 16) ? s16 : 0;
+            return scan_halves(x);
+        } else if constexpr (p == primitive::ds_bpermute) {
+            #pragma unroll
+            for (int s = 1; s < warpSize; s <<= 1) {
+                const auto prev = bpermute(x, lane - s);
+                x += lane >= s ? prev : 0;
+            }
+            return x;
+        } else if constexpr (p == primitive::readlane) {
+            int sum = 0;
+            int result = 0;
+            #pragma unroll
+            for (int i = 0; i < warpSize; ++i) {
+                sum += __builtin_amdgcn_readlane(x, i);
+                result = __builtin_amdgcn_writelane(sum, i, result);
+            }
+            return result;
+        } else {
+            static_assert(false, "unreachable");
+        }
+    }
+
+    // Returns `x` of lane `src_lane`, which must be the same in every lane, in every lane.
+    // DPP and ds_swizzle are not supported, as they can only reach the whole wave through
+    // readlane.
+    template <primitive p>
+    __device__ __forceinline__
+    int broadcast(int x, int src_lane) {
+        if constexpr (p == primitive::ds_bpermute) {
+            return detail::bpermute(x, src_lane);
+        } else if constexpr (p == primitive::readlane) {
+            return __builtin_amdgcn_readlane(x, src_lane);
+        } else {
+            static_assert(false, "unsupported primitive");
+        }
+    }
+}
+
+#endif